@@ -2,6 +2,8 @@
 //
 
 #include "cuckoo.h"
+#include "numa.h"
+#include "output.h"
 #include "threads.h"
 #include "tt.h"
 #include "uci.h"
@@ -27,8 +29,13 @@ int main(int argc, char** argv)
 
   UCI::init();
 
+  Numa::init();
+
+  Output::init();
+
   Threads::setThreadCount(UCI::Options["Threads"]);
-  TT::resize(UCI::Options["Hash"]);
+  // Quietly, the GUI isn't listening before uci. The uci response reports the table instead
+  TT::resize(UCI::Options["Hash"], false);
 
   NNUE::loadWeights();
 
@@ -36,5 +43,7 @@ int main(int argc, char** argv)
 
   Threads::setThreadCount(0);
 
+  Output::quit();
+
   return 0;
 }
\ No newline at end of file
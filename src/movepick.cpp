@@ -95,6 +95,15 @@ void MovePicker::scoreQuiets() {
       + (ss - 2)->contHistory[chIndex]
       + (ss - 4)->contHistory[chIndex]
       + (ss - 6)->contHistory[chIndex];
+
+    if (quietNoise) {
+      // splitmix64 finalizer
+      uint64_t h = noiseSeed ^ move;
+      h = (h ^ (h >> 30)) * 0xBF58476D1CE4E5B9ULL;
+      h = (h ^ (h >> 27)) * 0x94D049BB133111EBULL;
+      h ^= h >> 31;
+      quiets[i-1].score += int(h % (2 * quietNoise + 1)) - quietNoise;
+    }
   }
 }
 
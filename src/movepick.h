@@ -46,6 +46,11 @@ public:
 
   bool genQuietChecks = false;
 
+  // When non zero, each quiet gets a pseudo random bonus in [-quietNoise, quietNoise],
+  // which depends on noiseSeed and the move
+  int quietNoise = 0;
+  uint64_t noiseSeed = 0;
+
 private:
   SearchType searchType;
   Position& pos;
@@ -3,6 +3,8 @@
 #include "simd.h"
 #include "types.h"
 
+#include <string>
+
 using namespace SIMD;
 
 struct Position;
@@ -47,7 +49,8 @@ namespace NNUE {
 
   struct Accumulator {
     
-    alignas(Alignment) int16_t colors[COLOR_NB][L1];
+    // 64 whatever the vectors, so that the layout is the same for all kernels
+    alignas(64) int16_t colors[COLOR_NB][L1];
 
     bool updated[COLOR_NB];
     Square kings[COLOR_NB];
@@ -82,7 +85,31 @@ namespace NNUE {
 
   bool needRefresh(Color side, Square oldKing, Square newKing);
 
+  constexpr int MaxChainPlies = 16;
+
+  // Bring the 'plies' accumulators after lastUpdated up to date, for one side, in a single pass
+  // over the accumulator. Each of them is still written, for the siblings to start from.
+  // At most MaxChainPlies
+  void updateChain(Square kingSq, Color side, Accumulator* lastUpdated, int plies);
+
+  struct Net;
+
+  // Also picks the kernels for this CPU
   void loadWeights();
 
+  // Read a net file, check it and lay it out for the kernels. The file may end with the 8 byte
+  // checksum of the net, which must then match. Without it, only the size is checked: any file
+  // of the right length loads. An empty path gives the embedded net.
+  // Null on failure. 'info' tells what was loaded or what went wrong
+  Net* readNet(const std::string& path, std::string& info);
+
+  // Put 'net' in use and free the previous one. Only while no search runs
+  void setNet(Net* net);
+
+  // Instruction set of the kernels in use
+  const char* kernelsName();
+
+  // A side that isn't up to date must be one ply behind the accumulator before this one, with
+  // no refresh needed. It is updated as part of the evaluation
   Score evaluate(Position& pos, Accumulator& accumulator);
 }
\ No newline at end of file
@@ -0,0 +1,34 @@
+// NNUE kernels for AVX-512 (F, BW and VNNI). In a dispatch build they are compiled for it
+// whatever the flags of the build, otherwise only when it's the instruction set the build targets
+
+// Included before the pragma, so that their inline functions keep the flags of the build.
+// The linker keeps one copy of each, which must run anywhere
+#include "types.h"
+#include <immintrin.h>
+
+#if defined(USE_DISPATCH)
+#pragma GCC target("popcnt,ssse3,sse4.1,avx2,fma,avx512f,avx512bw,avx512vnni")
+#define SIMD_ARCH SIMD_AVX512
+#define SIMD_VNNI 1
+#endif
+
+#include "simd.h"
+
+#if SIMD_ARCH == SIMD_AVX512 && SIMD_VNNI
+
+#include "nnue_kernels_impl.h"
+
+const NNUE::Kernels* NNUE::avx512VnniKernels() {
+  static const Kernels kernels = makeKernels("AVX-512 VNNI");
+  return &kernels;
+}
+
+#else
+
+#include "nnue_kernels.h"
+
+const NNUE::Kernels* NNUE::avx512VnniKernels() {
+  return nullptr;
+}
+
+#endif
@@ -0,0 +1,34 @@
+// NNUE kernels for AVX2 (with FMA) and AVX-VNNI. In a dispatch build they are compiled for it
+// whatever the flags of the build, otherwise only when it's the instruction set the build targets
+
+// Included before the pragma, so that their inline functions keep the flags of the build.
+// The linker keeps one copy of each, which must run anywhere
+#include "types.h"
+#include <immintrin.h>
+
+#if defined(USE_DISPATCH)
+#pragma GCC target("popcnt,ssse3,sse4.1,avx2,fma,avxvnni")
+#define SIMD_ARCH SIMD_AVX2
+#define SIMD_VNNI 1
+#endif
+
+#include "simd.h"
+
+#if SIMD_ARCH == SIMD_AVX2 && SIMD_VNNI
+
+#include "nnue_kernels_impl.h"
+
+const NNUE::Kernels* NNUE::avxVnniKernels() {
+  static const Kernels kernels = makeKernels("AVX-VNNI");
+  return &kernels;
+}
+
+#else
+
+#include "nnue_kernels.h"
+
+const NNUE::Kernels* NNUE::avxVnniKernels() {
+  return nullptr;
+}
+
+#endif
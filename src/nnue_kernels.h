@@ -0,0 +1,72 @@
+#pragma once
+
+#include "nnue.h"
+
+namespace NNUE {
+
+  constexpr int FtShift = 9;
+
+  struct Net {
+    alignas(64) int16_t FeatureWeights[KingBuckets][2][6][64][L1];
+    alignas(64) int16_t FeatureBiases[L1];
+
+    union {
+      alignas(64) int8_t L1Weights[OutputBuckets][L1][L2];
+      alignas(64) int8_t L1WeightsAlt[OutputBuckets][L1 * L2];
+    }; 
+    alignas(64) float L1Biases[OutputBuckets][L2];
+
+    alignas(64) float L2Weights[OutputBuckets][L2 * 2][L3];
+    alignas(64) float L2Biases[OutputBuckets][L3];
+
+    alignas(64) float L3Weights[OutputBuckets][L3];
+    alignas(64) float L3Biases[OutputBuckets];
+  };
+
+  extern Net* Weights;
+
+  // For every possible uint8 number, the index of each active bit
+  extern uint16_t nnzTable[256][8];
+
+  // Weight rows one ply removes and adds
+  struct FeatureDelta {
+    const int16_t* sub[2];
+    const int16_t* add[2];
+    int subCount, addCount;
+  };
+
+  // The accumulator updates and the evaluation, built for one instruction set.
+  // Vectors are L1 int16 wide, aligned to 64 bytes
+  struct Kernels {
+    const char* name;
+
+    // How the feature weights are permuted, so that packus needs no permute
+    const int* packusOrder;
+    int packusRegs;
+
+    void (*add)(int16_t* output, const int16_t* input, const int16_t* add0);
+    void (*sub)(int16_t* output, const int16_t* input, const int16_t* sub0);
+    void (*subAdd)(int16_t* output, const int16_t* input, const int16_t* sub0, const int16_t* add0);
+    void (*subAddSub)(int16_t* output, const int16_t* input,
+                      const int16_t* sub0, const int16_t* add0, const int16_t* sub1);
+    void (*subAddSubAdd)(int16_t* output, const int16_t* input,
+                         const int16_t* sub0, const int16_t* add0, const int16_t* sub1, const int16_t* add1);
+
+    // outputs[i] = outputs[i-1] + deltas[i], starting from input. Each tile of the accumulator
+    // is loaded once and kept in registers through all the plies
+    void (*updateChain)(int16_t** outputs, const int16_t* input, const FeatureDelta* deltas, int plies);
+
+    // Perspectives are [0] side to move, [1] the other. When deltas[i] is set, inputs[i] is the
+    // parent accumulator: the update to outputs[i] is done during the activation, in one pass
+    Score (*evaluate)(const int16_t* const* inputs, int16_t* const* outputs,
+                      const FeatureDelta* const* deltas, int bucket);
+  };
+
+  // Each is null unless this build has it. A build for one target (native, avx2, ...) has only
+  // the kernels of that target, a dispatch build has all of them
+  const Kernels* ssse3Kernels();
+  const Kernels* avx2Kernels();
+  const Kernels* avxVnniKernels();
+  const Kernels* avx512Kernels();
+  const Kernels* avx512VnniKernels();
+}
@@ -0,0 +1,300 @@
+#pragma once
+
+// Kernel bodies, compiled once for each instruction set by the nnue_<arch>.cpp files.
+// Everything here is file local, what leaves the file is the Kernels table
+
+#include "nnue_kernels.h"
+
+#define AsVecI(x) *(VecI*)(&x)
+#define AsVecF(x) *(VecF*)(&x)
+
+namespace NNUE {
+
+  namespace {
+
+  constexpr int FloatInVec = sizeof(VecI) / sizeof(float);
+  constexpr int I16InVec = sizeof(VecI) / sizeof(int16_t);
+  constexpr int I8InVec = sizeof(VecI) / sizeof(int8_t);
+
+  void multiAdd(int16_t* output, const int16_t* input, const int16_t* add0) {
+    VecI* out = (VecI*) output;
+    const VecI* in = (const VecI*) input;
+    const VecI* a0 = (const VecI*) add0;
+    for (int i = 0; i < L1 / I16InVec; ++i)
+      out[i] = addEpi16(in[i], a0[i]);
+  }
+
+  void multiSub(int16_t* output, const int16_t* input, const int16_t* sub0) {
+    VecI* out = (VecI*) output;
+    const VecI* in = (const VecI*) input;
+    const VecI* s0 = (const VecI*) sub0;
+    for (int i = 0; i < L1 / I16InVec; ++i)
+      out[i] = subEpi16(in[i], s0[i]);
+  }
+
+  void multiSubAdd(int16_t* output, const int16_t* input, const int16_t* sub0, const int16_t* add0) {
+    VecI* out = (VecI*) output;
+    const VecI* in = (const VecI*) input;
+    const VecI* s0 = (const VecI*) sub0;
+    const VecI* a0 = (const VecI*) add0;
+    for (int i = 0; i < L1 / I16InVec; ++i)
+      out[i] = subEpi16(addEpi16(in[i], a0[i]), s0[i]);
+  }
+
+  void multiSubAddSub(int16_t* output, const int16_t* input,
+                      const int16_t* sub0, const int16_t* add0, const int16_t* sub1) {
+    VecI* out = (VecI*) output;
+    const VecI* in = (const VecI*) input;
+    const VecI* s0 = (const VecI*) sub0;
+    const VecI* a0 = (const VecI*) add0;
+    const VecI* s1 = (const VecI*) sub1;
+    for (int i = 0; i < L1 / I16InVec; ++i)
+      out[i] = subEpi16(addEpi16(in[i], a0[i]), addEpi16(s0[i], s1[i]));
+  }
+
+  void multiSubAddSubAdd(int16_t* output, const int16_t* input,
+                         const int16_t* sub0, const int16_t* add0, const int16_t* sub1, const int16_t* add1) {
+    VecI* out = (VecI*) output;
+    const VecI* in = (const VecI*) input;
+    const VecI* s0 = (const VecI*) sub0;
+    const VecI* a0 = (const VecI*) add0;
+    const VecI* s1 = (const VecI*) sub1;
+    const VecI* a1 = (const VecI*) add1;
+    for (int i = 0; i < L1 / I16InVec; ++i)
+      out[i] = addEpi16(in[i], subEpi16(addEpi16(a0[i], a1[i]), addEpi16(s0[i], s1[i])));
+  }
+
+  void updateChain(int16_t** outputs, const int16_t* input, const FeatureDelta* deltas, int plies) {
+    // 8 vectors, so that with the operands they fit in 16 registers
+    constexpr int TileVecs = 8;
+    static_assert(L1 / I16InVec % TileVecs == 0);
+
+    const VecI* in = (const VecI*) input;
+
+    for (int t = 0; t < L1 / I16InVec; t += TileVecs) {
+      VecI regs[TileVecs];
+      for (int j = 0; j < TileVecs; j++)
+        regs[j] = in[t + j];
+
+      for (int p = 0; p < plies; p++) {
+        const FeatureDelta& d = deltas[p];
+
+        for (int k = 0; k < d.subCount; k++) {
+          const VecI* row = (const VecI*) d.sub[k];
+          for (int j = 0; j < TileVecs; j++)
+            regs[j] = subEpi16(regs[j], row[t + j]);
+        }
+        for (int k = 0; k < d.addCount; k++) {
+          const VecI* row = (const VecI*) d.add[k];
+          for (int j = 0; j < TileVecs; j++)
+            regs[j] = addEpi16(regs[j], row[t + j]);
+        }
+
+        VecI* out = (VecI*) outputs[p];
+        for (int j = 0; j < TileVecs; j++)
+          out[t + j] = regs[j];
+      }
+    }
+  }
+
+  // Apply the rows of one ply to v, which was loaded from 'offset' in the accumulator
+  inline VecI applyDelta(VecI v, const FeatureDelta* delta, int offset) {
+    for (int k = 0; k < delta->subCount; k++)
+      v = subEpi16(v, AsVecI(delta->sub[k][offset]));
+    for (int k = 0; k < delta->addCount; k++)
+      v = addEpi16(v, AsVecI(delta->add[k][offset]));
+    return v;
+  }
+
+  // Clamp, multiply pairwise and pack one perspective into ftOut. With Update, the input is the
+  // parent accumulator: each vector gets the delta of the ply before it's activated, and is
+  // stored to the output for the children, all in the same pass
+  template<bool Update>
+  inline void activateSide(uint8_t* ftOut, const int16_t* acc, int16_t* output, const FeatureDelta* delta,
+                           uint16_t* nnzIndexes, int& nnzCount, __m128i& base) {
+    const __m128i lookupInc = _mm_set1_epi16(8);
+    const VecI veciZero = setzeroSi();
+    const VecI veciOne = set1Epi16(NetworkQA);
+
+    for (int i = 0; i < L1 / 2; i += I8InVec) 
+    {
+      VecI a0 = AsVecI(acc[i]);
+      VecI a1 = AsVecI(acc[i + L1/2]);
+      VecI b0 = AsVecI(acc[i + I16InVec]);
+      VecI b1 = AsVecI(acc[i + L1/2 + I16InVec]);
+
+      if constexpr (Update) {
+        AsVecI(output[i]) = a0 = applyDelta(a0, delta, i);
+        AsVecI(output[i + L1/2]) = a1 = applyDelta(a1, delta, i + L1/2);
+        AsVecI(output[i + I16InVec]) = b0 = applyDelta(b0, delta, i + I16InVec);
+        AsVecI(output[i + L1/2 + I16InVec]) = b1 = applyDelta(b1, delta, i + L1/2 + I16InVec);
+      }
+
+      VecI c0 = minEpi16(maxEpi16(a0, veciZero), veciOne);
+      VecI c1 = minEpi16(a1, veciOne);
+
+      VecI d0 = minEpi16(maxEpi16(b0, veciZero), veciOne);
+      VecI d1 = minEpi16(b1, veciOne);
+
+      VecI cProd = mulhiEpi16(slliEpi16(c0, 16 - FtShift), c1);
+      VecI dProd = mulhiEpi16(slliEpi16(d0, 16 - FtShift), d1);
+
+      VecI packed = packusEpi16(cProd, dProd);
+      AsVecI(ftOut[i]) = packed;
+
+#if SIMD_ARCH >= SIMD_AVX2
+      // a bit mask where each bit (x) is 1, if the xth int32 in the product is > 0
+      uint16_t nnzMask = getNnzMask(packed);
+
+      // Usually (in AVX2) only one lookup is needed, as there are 8 ints in a vec.
+      for (int lookup = 0; lookup < FloatInVec; lookup += 8) {
+        uint8_t slice = (nnzMask >> lookup) & 0xFF;
+        __m128i indexes = _mm_loadu_si128((__m128i*)nnzTable[slice]);
+        _mm_storeu_si128((__m128i*)(nnzIndexes + nnzCount), _mm_add_epi16(base, indexes));
+        nnzCount += BitCount(slice);
+        base = _mm_add_epi16(base, lookupInc);
+      }
+#endif
+    }
+  }
+
+  Score evaluate(const int16_t* const* inputs, int16_t* const* outputs,
+                 const FeatureDelta* const* deltas, int bucket) {
+
+    __m128i base = _mm_setzero_si128();
+    __m128i lookupInc = _mm_set1_epi16(8);
+
+    VecF vecfZero = setzeroPs();
+    VecF vecfOne = set1Ps(1.0f);
+
+    // L1 propagation is int8 -> float, so we multiply 4 ft outputs at a time
+    uint16_t nnzIndexes[L1 / 4];
+    int nnzCount = 0;
+
+    alignas(Alignment) uint8_t ftOut[L1];
+    alignas(Alignment) float l1Out[L2 * 2];
+    alignas(Alignment) float l2Out[L3];
+    float l3Out;
+
+    constexpr float L1Mul = 1.0f / float(NetworkQA * NetworkQA * NetworkQB >> FtShift);
+    VecF L1MulVec = set1Ps(L1Mul);
+
+    // activate FT
+    for (int side = 0; side <= 1; ++side) {
+      if (deltas[side])
+        activateSide<true>(ftOut + side * L1 / 2, inputs[side], outputs[side], deltas[side],
+                           nnzIndexes, nnzCount, base);
+      else
+        activateSide<false>(ftOut + side * L1 / 2, inputs[side], nullptr, nullptr,
+                            nnzIndexes, nnzCount, base);
+    }
+
+#if SIMD_ARCH < SIMD_AVX2 // if we are in SSSE3
+    for (int i = 0; i < L1; i += 2 * I8InVec) {
+      // a bit mask where each bit (x) is 1, if the xth int32 in the product is > 0
+      uint16_t nnzMask = getNnzMask(AsVecI(ftOut[i]));
+      nnzMask |= getNnzMask(AsVecI(ftOut[i + I8InVec])) << 4;
+
+      // Usually (in AVX2) only one lookup is needed, as there are 8 ints in a vec.
+      uint8_t slice = nnzMask & 0xFF;
+      __m128i indexes = _mm_loadu_si128((__m128i*)nnzTable[slice]);
+      _mm_storeu_si128((__m128i*)(nnzIndexes + nnzCount), _mm_add_epi16(base, indexes));
+      nnzCount += BitCount(slice);
+      base = _mm_add_epi16(base, lookupInc);
+    }
+#endif
+
+    { // propagate l1
+
+      // Nonzero chunks go to Partials separate sums in turn. With VNNI the dpbusd latency
+      // would otherwise bound the loop, as each one waits for the previous
+      constexpr int Partials = 4;
+      constexpr int SumVecs = L2 / FloatInVec;
+      VecI partial[Partials][SumVecs];
+      for (int p = 0; p < Partials; p++)
+        for (int j = 0; j < SumVecs; j++)
+          partial[p][j] = setzeroSi();
+
+      auto addChunk = [&](VecI* sum, int nnz) {
+        int l1in = nnz*4;
+        VecI vecFtOut = set1Epi32( *(uint32_t*)(ftOut + l1in) );
+        for (int j = 0; j < SumVecs; j++) {
+          VecI vecWeight = AsVecI(Weights->L1Weights[bucket][l1in + j * FloatInVec / 4]);
+          sum[j] = dpbusdEpi32(sum[j], vecFtOut, vecWeight);
+        }
+      };
+
+      int i = 0;
+      for (; i + Partials <= nnzCount; i += Partials)
+        for (int p = 0; p < Partials; p++)
+          addChunk(partial[p], nnzIndexes[i + p]);
+      for (; i < nnzCount; i++)
+        addChunk(partial[0], nnzIndexes[i]);
+
+      alignas(Alignment) int32_t sums[L2];
+      for (int j = 0; j < SumVecs; j++)
+        AsVecI(sums[j * FloatInVec]) = addEpi32(addEpi32(partial[0][j], partial[1][j]),
+                                                addEpi32(partial[2][j], partial[3][j]));
+
+      for (int i = 0; i < L2; i += FloatInVec) {
+        VecF vecBias = AsVecF(Weights->L1Biases[bucket][i]);
+        VecF prod = mulAddPs(castEpi32ToPs(AsVecI(sums[i])), L1MulVec, vecBias);
+        VecF squared = mulPs(prod, prod);
+
+        AsVecF(l1Out[i]) = minPs(maxPs(prod, vecfZero), vecfOne);
+        AsVecF(l1Out[i + L2]) = minPs(squared, vecfOne);
+      }
+    }
+
+    constexpr int Chunks = 64 / sizeof(VecF);
+
+    { // propagate l2
+      alignas(Alignment) float sums[L3];
+      memcpy(sums, Weights->L2Biases[bucket], sizeof(sums));
+
+      for (int i = 0; i < L2 * 2; ++i) {
+        VecF vecL1Out = set1Ps(l1Out[i]);
+        for (int j = 0; j < L3; j += FloatInVec)
+          AsVecF(sums[j]) = mulAddPs(AsVecF(Weights->L2Weights[bucket][i][j]), vecL1Out, AsVecF(sums[j]));
+      }
+
+      for (int i = 0; i < L3; i += FloatInVec)
+        AsVecF(l2Out[i]) = minPs(maxPs(AsVecF(sums[i]), vecfZero), vecfOne);
+    }
+
+    { // propagate l3
+      VecF sums[Chunks];
+      for (int j = 0; j < Chunks; j++)
+        sums[j] = vecfZero;
+      for (int i = 0; i < L3; i += FloatInVec * Chunks) {
+        for (int j = 0; j < Chunks; j++)
+          sums[j] = mulAddPs(AsVecF(l2Out[i + j * FloatInVec]), AsVecF( Weights->L3Weights[bucket][i + j * FloatInVec]), sums[j]);
+      }
+
+      VecF totalSum = sums[0];
+      for (int j = 1; j < Chunks; j++)
+        totalSum = addPs(totalSum, sums[j]);
+      
+      l3Out = Weights->L3Biases[bucket] + reduceAddPs(totalSum);
+    }
+
+    return l3Out * NetworkScale;
+  }
+
+  Kernels makeKernels(const char* name) {
+    Kernels k;
+    k.name = name;
+    k.packusOrder = PackusOrder;
+    k.packusRegs = sizeof(VecI) / 8; // 128 bit blocks of the two vectors packus takes
+    k.add = multiAdd;
+    k.sub = multiSub;
+    k.subAdd = multiSubAdd;
+    k.subAddSub = multiSubAddSub;
+    k.subAddSubAdd = multiSubAddSubAdd;
+    k.updateChain = updateChain;
+    k.evaluate = evaluate;
+    return k;
+  }
+
+  } // namespace
+}
@@ -0,0 +1,33 @@
+// NNUE kernels for SSSE3. In a dispatch build they are compiled for it whatever the flags
+// of the build, otherwise only when it's the instruction set the build targets
+
+// Included before the pragma, so that their inline functions keep the flags of the build.
+// The linker keeps one copy of each, which must run anywhere
+#include "types.h"
+#include <immintrin.h>
+
+#if defined(USE_DISPATCH)
+#pragma GCC target("popcnt,ssse3")
+#define SIMD_ARCH SIMD_SSSE3
+#endif
+
+#include "simd.h"
+
+#if SIMD_ARCH == SIMD_SSSE3
+
+#include "nnue_kernels_impl.h"
+
+const NNUE::Kernels* NNUE::ssse3Kernels() {
+  static const Kernels kernels = makeKernels("SSSE3");
+  return &kernels;
+}
+
+#else
+
+#include "nnue_kernels.h"
+
+const NNUE::Kernels* NNUE::ssse3Kernels() {
+  return nullptr;
+}
+
+#endif
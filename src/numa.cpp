@@ -0,0 +1,87 @@
+#include "numa.h"
+
+#if defined(__linux__)
+#include <sched.h>
+#endif
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <vector>
+
+namespace Numa {
+
+  std::vector<std::vector<int>> nodeCpus;
+  bool enabled = false;
+
+  // Parse a sysfs list such as "0-15,32-47"
+  std::vector<int> parseList(const std::string& str) {
+    std::vector<int> result;
+    std::stringstream ss(str);
+    std::string range;
+
+    while (std::getline(ss, range, ',')) {
+      if (range.empty() || range == "\n")
+        continue;
+      size_t dash = range.find('-');
+      int first = std::stoi(range.substr(0, dash));
+      int last = dash == std::string::npos ? first : std::stoi(range.substr(dash + 1));
+      for (int i = first; i <= last; i++)
+        result.push_back(i);
+    }
+    return result;
+  }
+
+  std::string readLine(const std::string& path) {
+    std::ifstream file(path);
+    std::string line;
+    std::getline(file, line);
+    return line;
+  }
+
+  void init() {
+    nodeCpus.clear();
+
+#if defined(__linux__)
+    cpu_set_t allowed;
+    CPU_ZERO(&allowed);
+    if (sched_getaffinity(0, sizeof(allowed), &allowed))
+      return;
+
+    for (int node : parseList(readLine("/sys/devices/system/node/online"))) {
+      std::vector<int> cpus;
+      for (int cpu : parseList(readLine("/sys/devices/system/node/node" + std::to_string(node) + "/cpulist")))
+        if (cpu < CPU_SETSIZE && CPU_ISSET(cpu, &allowed))
+          cpus.push_back(cpu);
+
+      // Skip memory-only nodes and nodes we are not allowed to run on
+      if (!cpus.empty())
+        nodeCpus.push_back(cpus);
+    }
+#endif
+  }
+
+  void setEnabled(bool _enabled) {
+    enabled = _enabled;
+  }
+
+  int nodeCount() {
+    return enabled && nodeCpus.size() > 1 ? nodeCpus.size() : 1;
+  }
+
+  int nodeOf(int threadIndex) {
+    return threadIndex % nodeCount();
+  }
+
+  void bindThisThread(int threadIndex) {
+    if (nodeCount() == 1)
+      return;
+
+#if defined(__linux__)
+    cpu_set_t mask;
+    CPU_ZERO(&mask);
+    for (int cpu : nodeCpus[nodeOf(threadIndex)])
+      CPU_SET(cpu, &mask);
+    sched_setaffinity(0, sizeof(mask), &mask);
+#endif
+  }
+}
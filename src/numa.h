@@ -0,0 +1,19 @@
+#pragma once
+
+namespace Numa {
+
+  // Detect the NUMA nodes (and their cpus) this process is allowed to run on
+  void init();
+
+  void setEnabled(bool enabled);
+
+  // 1 when NUMA mode is disabled or the machine has a single node
+  int nodeCount();
+
+  // The node that the thread with this index (search thread or TT::clear helper) runs on
+  int nodeOf(int threadIndex);
+
+  // Restrict the calling thread to the cpus of nodeOf(threadIndex). Memory that the thread
+  // touches first is then allocated on that node by the kernel
+  void bindThisThread(int threadIndex);
+}
@@ -0,0 +1,100 @@
+#include "output.h"
+
+#include <atomic>
+#include <condition_variable>
+#include <iostream>
+#include <mutex>
+#include <thread>
+
+namespace Output {
+
+  // Single producer, single consumer ring. Slots in [head, tail) are waiting to be written.
+  // Only the producer moves tail and only the writer moves head, so neither needs a lock.
+  // Producers (the main search thread, the input reader) take turns with postMutex
+  constexpr size_t Capacity = 1024;
+
+  std::string slots[Capacity];
+
+  alignas(64) std::atomic<size_t> head(0);
+  alignas(64) std::atomic<size_t> tail(0);
+
+  std::mutex postMutex;
+
+  std::thread writer;
+  std::atomic<bool> running(false);
+
+  // Only used to sleep while the ring is empty. The producer takes the mutex between moving
+  // tail and notifying, so the writer either sees the new tail or gets the notification
+  std::mutex sleepMutex;
+  std::condition_variable sleepCv;
+
+  void wakeWriter() {
+    { std::lock_guard lock(sleepMutex); }
+    sleepCv.notify_one();
+  }
+
+  void writerLoop() {
+    while (true) {
+      size_t h = head.load(std::memory_order_relaxed);
+      const size_t t = tail.load(std::memory_order_acquire);
+
+      if (h == t) {
+        if (!running)
+          return;
+
+        std::unique_lock lock(sleepMutex);
+        sleepCv.wait(lock, [&] { return tail.load(std::memory_order_acquire) != h || !running; });
+        continue;
+      }
+
+      // One insert per line, so that nothing written to std::cout directly lands in between
+      for (; h != t; h++) {
+        slots[h % Capacity] += '\n';
+        std::cout << slots[h % Capacity];
+      }
+      std::cout.flush();
+
+      // Only now can the producer reuse the slots
+      head.store(h, std::memory_order_release);
+    }
+  }
+
+  void init() {
+    running = true;
+    writer = std::thread(writerLoop);
+  }
+
+  void quit() {
+    if (!running)
+      return;
+
+    running = false;
+    wakeWriter();
+    writer.join();
+  }
+
+  void post(std::string line) {
+    if (!running) {
+      std::cout << line << std::endl;
+      return;
+    }
+
+    std::lock_guard postLock(postMutex);
+
+    const size_t t = tail.load(std::memory_order_relaxed);
+
+    // Full: the reader of stdout is far behind, there is nothing better to do than wait
+    while (t - head.load(std::memory_order_acquire) >= Capacity)
+      std::this_thread::yield();
+
+    slots[t % Capacity] = std::move(line);
+    tail.store(t + 1, std::memory_order_release);
+    wakeWriter();
+  }
+
+  void flush() {
+    const size_t t = tail.load(std::memory_order_acquire);
+    while (head.load(std::memory_order_acquire) < t)
+      std::this_thread::yield();
+  }
+}
@@ -0,0 +1,21 @@
+#pragma once
+
+#include <string>
+
+namespace Output {
+
+  // Start the thread that writes posted lines to stdout
+  void init();
+
+  // Write out what is left, and stop the thread
+  void quit();
+
+  // Queue a line (without the newline) to be written by the output thread, so that a slow
+  // reader on the other end of stdout doesn't block the caller. Lines come out in the order
+  // they were posted. Callers on different threads are serialized
+  void post(std::string line);
+
+  // Wait until every line posted so far has been written. Call this before writing to
+  // std::cout directly, when the order with posted lines matters (after bestmove, readyok)
+  void flush();
+}
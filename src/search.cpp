@@ -2,6 +2,7 @@
 #include "cuckoo.h"
 #include "evaluate.h"
 #include "movepick.h"
+#include "output.h"
 #include "fathom/src/tbprobe.h"
 #include "timeman.h"
 #include "threads.h"
@@ -82,11 +83,21 @@ namespace Search {
 
   int lmrTable[MAX_PLY][MAX_MOVES];
 
+  // With SMP Depth Skip, helper i skips every other block of SkipSize[k] iterations, starting
+  // SkipPhase[k] iterations in (k = (i-1) % 20). Helpers end up spread over several depths
+  constexpr int SkipSize[20]  = { 1, 1, 2, 2, 2, 2, 3, 3, 3, 3, 3, 3, 4, 4, 4, 4, 4, 4, 4, 4 };
+  constexpr int SkipPhase[20] = { 0, 1, 0, 1, 2, 3, 0, 1, 2, 3, 4, 5, 0, 1, 2, 3, 4, 5, 6, 7 };
+
+  // A new root is looked for this many plies into the last PV: the same position, or the one
+  // after our move and the expected reply
+  constexpr int ReuseMaxPly = 2;
+
   Settings::Settings() {
     time[WHITE] = time[BLACK] = inc[WHITE] = inc[BLACK] = movetime = 0;
     movestogo = 0;
     depth = MAX_PLY-4; // no depth limit by default
     nodes = 0;
+    ponder = false;
   }
 
   Move moveFromTbProbeRoot(unsigned tbResult) {
@@ -147,6 +158,7 @@ namespace Search {
     memset(contCorrHist, 0, sizeof(contCorrHist));
 
     searchPrevScore = SCORE_NONE;
+    prevPvLength = 0;
   }
 
   Thread::Thread()
@@ -155,7 +167,7 @@ namespace Search {
   }
 
   template<bool root>
-  int64_t perft(Position& pos, int depth) {
+  int64_t perft(Position& pos, int depth, const std::atomic<bool>& stop) {
 
     MoveList moves;
     getStageMoves(pos, ADD_ALL_MOVES, &moves);
@@ -171,6 +183,10 @@ namespace Search {
     for (int i = 0; i < moves.size(); i++) {
       Move move = moves[i].move;
 
+      // Checked above the leaves only, so that it costs nothing noticeable
+      if (stop.load(std::memory_order_relaxed))
+        break;
+
       if (!pos.isLegal(move))
         continue;
 
@@ -179,17 +195,21 @@ namespace Search {
       Position newPos = pos;
       newPos.doMove(move, dirtyPieces);
 
-      int64_t thisNodes = perft<false>(newPos, depth - 1);
-      if constexpr (root)
-        std::cout << UCI::moveToString(move) << " -> " << thisNodes << std::endl;
+      int64_t thisNodes = perft<false>(newPos, depth - 1, stop);
+      if constexpr (root) {
+        if (stop)
+          break;
+        // Posted, as the input thread may answer isready meanwhile
+        Output::post(UCI::moveToString(move) + " -> " + std::to_string(thisNodes));
+      }
 
       n += thisNodes;
     }
     return n;
   }
 
-  template int64_t perft<false>(Position&, int);
-  template int64_t perft<true>(Position&, int);
+  template int64_t perft<false>(Position&, int, const std::atomic<bool>&);
+  template int64_t perft<true>(Position&, int, const std::atomic<bool>&);
 
   int64_t elapsedTime() {
     return timeMillis() - Threads::getSearchSettings().startTime;
@@ -197,24 +217,34 @@ namespace Search {
 
   void printInfo(int depth, int pvIdx, Score score, const std::string& pvString) {
     const int64_t elapsed = elapsedTime();
+    const uint64_t nodes = Threads::totalNodes();
+
+    // With MultiPV, sample the table once for all the lines
+    static int hashfull;
+    if (pvIdx == 1)
+      hashfull = TT::hashfull();
+
     std::ostringstream infoStr;
         infoStr
           << "info"
           << " depth "    << depth
           << " multipv "  << pvIdx
           << " score "    << UCI::scoreToString(score)
-          << " nodes "    << Threads::totalNodes()
-          << " nps "      << (Threads::totalNodes() * 1000ULL) / std::max<int64_t>(elapsed, 1LL)
-          << " hashfull " << TT::hashfull()
+          << " nodes "    << nodes
+          << " nps "      << (nodes * 1000ULL) / std::max<int64_t>(elapsed, 1LL)
+          << " hashfull " << hashfull
           << " tbhits "   << Threads::totalTbHits()
           << " time "     << elapsed
           << " pv "       << pvString;
 
-    std::cout << infoStr.str() << std::endl;
+    Output::post(infoStr.str());
   }
 
-  void printBestMove(Move move) {
-    std::cout << "bestmove " << UCI::moveToString(move) << std::endl;
+  void printBestMove(Move move, Move ponderMove) {
+    std::string str = "bestmove " + UCI::moveToString(move);
+    if (ponderMove)
+      str += " ponder " + UCI::moveToString(ponderMove);
+    Output::post(str);
   }
 
   int statBonus(int d) {
@@ -298,40 +328,61 @@ namespace Search {
   void Thread::updateAccumulator(Position& pos, NNUE::Accumulator& head) {
 
     for (Color side = WHITE; side <= BLACK; ++side) {
-      if (head.updated[side])
-        continue;
+      if (!head.updated[side])
+        updateAccumulator(pos, head, side);
+    }
+  }
 
-      const Square king = head.kings[side];
-      NNUE::Accumulator* iter = &head;
-      while (true) {
-        iter--;
+  void Thread::updateAccumulator(Position& pos, NNUE::Accumulator& head, Color side) {
 
-        if (NNUE::needRefresh(side, iter->kings[side], king)) {
-          refreshAccumulator(pos, head, side);
-          break;
-        }
+    const Square king = head.kings[side];
+    NNUE::Accumulator* iter = &head;
+    while (true) {
+      iter--;
 
-        if (iter->updated[side]) {
-          NNUE::Accumulator* lastUpdated = iter;
-          while (lastUpdated != &head) {
-            (lastUpdated+1)->doUpdates(king, side, *lastUpdated);
-            lastUpdated++;
-          }
-          break;
-        }
+      if (NNUE::needRefresh(side, iter->kings[side], king)) {
+        refreshAccumulator(pos, head, side);
+        break;
+      }
+
+      if (iter->updated[side]) {
+        // One ply goes through the kernel specialized for its kind of move. Several are
+        // applied together, so that the accumulator is read once for all of them
+        const int plies = int(&head - iter);
+        if (plies == 1)
+          head.doUpdates(king, side, *iter);
+        else
+          for (int done = 0; done < plies; done += NNUE::MaxChainPlies)
+            NNUE::updateChain(king, side, iter + done, std::min(plies - done, NNUE::MaxChainPlies));
+        break;
       }
     }
   }
 
   Score Thread::doEvaluation(Position& pos) {
     NNUE::Accumulator& acc = accumStack[accumStackHead];
-    updateAccumulator(pos, acc);
+
+    // A side one ply behind is left to the evaluation, which updates it while activating it
+    for (Color side = WHITE; side <= BLACK; ++side) {
+      if (acc.updated[side])
+        continue;
+
+      NNUE::Accumulator& parent = *(&acc - 1);
+      if (!parent.updated[side] || NNUE::needRefresh(side, parent.kings[side], acc.kings[side]))
+        updateAccumulator(pos, acc, side);
+    }
+
     return Eval::evaluate(pos, !(ply % 2), acc);
   }
 
   void Thread::playMove(Position& pos, Move move, SearchInfo* ss) {
 
-    nodesSearched++;
+    nodesSearched.increment();
+    if (nodesSearched.get() % NodesPublishPeriod == 0) {
+      Threads::publishNodes(NodesPublishPeriod);
+      if (Threads::isDeterministic() && nodesSearched.get() % DeterministicQuantum == 0)
+        Threads::quantumBarrier();
+    }
 
     const bool isCap = pos.board[move_to(move)] != NO_PIECE;
     ss->contCorrHist = contCorrHist[pieceTo(pos, move)];
@@ -501,7 +552,8 @@ namespace Search {
     // Probe TT
     const Key posTtKey = pos.key ^ ZOBRIST_50MR[pos.halfMoveClock];
     bool ttHit;
-    TT::Entry* ttEntry = TT::probe(posTtKey, ttHit);
+    TT::EntryData ttData;
+    TT::Entry* ttEntry = TT::probeQs(posTtKey, ttHit, ttData);
     TT::Flag ttBound = TT::NO_FLAG;
     Score ttScore = SCORE_NONE;
     Move ttMove = MOVE_NONE;
@@ -509,18 +561,20 @@ namespace Search {
     bool ttPV = false;
 
     if (ttHit) {
-      ttBound = ttEntry->getBound();
-      ttScore = ttEntry->getScore(ply);
-      ttMove = ttEntry->getMove();
-      ttStaticEval = ttEntry->getStaticEval();
-      ttPV = ttEntry->wasPV();
+      ttBound = ttData.getBound();
+      ttScore = ttData.getScore(ply);
+      ttMove = ttData.getMove();
+      ttStaticEval = ttData.getStaticEval();
+      ttPV = ttData.wasPV();
     }
 
     // In non PV nodes, if tt bound allows it, return ttScore
     if ( !IsPV
       && ttScore != SCORE_NONE
-      && canUseScore(ttBound, ttScore, beta))
-        return ttScore;
+      && canUseScore(ttBound, ttScore, beta)) {
+      ttStats.cutoffs++;
+      return ttScore;
+    }
 
     Move bestMove = MOVE_NONE;
     Score rawStaticEval;
@@ -572,7 +626,7 @@ namespace Search {
 
     while (move = movePicker.nextMove(false)) {
 
-      TT::prefetch(pos.keyAfter(move));
+      TT::prefetchQs(pos.keyAfter(move));
 
       if (!pos.isLegal(move))
         continue;
@@ -668,7 +722,8 @@ namespace Search {
     ++maxTimeCounter;
     if ( this == Threads::mainThread()
       && (maxTimeCounter & 4095) == 0
-      && elapsedTime() >= maxTime)
+      && elapsedTime() >= maxTime
+      && !Threads::isPondering())
         Threads::stopSearch();
 
     if (Threads::isSearchStopped())
@@ -709,7 +764,8 @@ namespace Search {
     // Probe TT
     const Key posTtKey = pos.key ^ ZOBRIST_50MR[pos.halfMoveClock];
     bool ttHit;
-    TT::Entry* ttEntry = TT::probe(posTtKey, ttHit);
+    TT::EntryData ttData;
+    TT::Entry* ttEntry = TT::probe(posTtKey, ttHit, ttData);
 
     TT::Flag ttBound = TT::NO_FLAG;
     Score ttScore   = SCORE_NONE;
@@ -719,12 +775,12 @@ namespace Search {
     bool ttPV = IsPV;
 
     if (ttHit) {
-      ttBound = ttEntry->getBound();
-      ttScore = ttEntry->getScore(ply);
-      ttMove = ttEntry->getMove();
-      ttDepth = ttEntry->getDepth();
-      ttStaticEval = ttEntry->getStaticEval();
-      ttPV |= ttEntry->wasPV();
+      ttBound = ttData.getBound();
+      ttScore = ttData.getScore(ply);
+      ttMove = ttData.getMove();
+      ttDepth = ttData.getDepth();
+      ttStaticEval = ttData.getStaticEval();
+      ttPV |= ttData.wasPV();
     }
 
     if (IsRoot)
@@ -755,6 +811,7 @@ namespace Search {
         int chIndex = pos.board[prevSq] * SQUARE_NB + prevSq;
         addToContHistory(chIndex, -statMalus(depth), ss-1);
       }
+      ttStats.cutoffs++;
       return ttScore;
     }
 
@@ -763,7 +820,7 @@ namespace Search {
 
     if (tbResult != TB_RESULT_FAILED) {
 
-      tbHits++;
+      tbHits.increment();
       Score tbScore;
       TT::Flag tbBound;
 
@@ -965,6 +1022,11 @@ namespace Search {
       mainHistory, pawnHistory, captureHistory,
       0, ss);
 
+    if (IsRoot && rootNoise) {
+      movePicker.quietNoise = rootNoise;
+      movePicker.noiseSeed = rootNoiseSeed;
+    }
+
     // Visit moves
 
     Move move;
@@ -988,7 +1050,7 @@ namespace Search {
 
       int history = isQuiet ? getQuietHistory(pos, move, ss) : getCapHistory(pos, move);
 
-      int oldNodesSearched = nodesSearched;
+      int oldNodesSearched = nodesSearched.get();
 
       if ( !IsRoot
         && bestScore > SCORE_TB_LOSS_IN_MAX_PLY
@@ -1118,7 +1180,7 @@ namespace Search {
 
       if (IsRoot) {
         RootMove& rm = rootMoves[rootMoves.indexOf(move)];
-        rm.nodes += nodesSearched - oldNodesSearched;
+        rm.nodes += nodesSearched.get() - oldNodesSearched;
 
         rm.averageScore = rm.averageScore != SCORE_NONE ? (rm.averageScore + score) / 2 : score;
 
@@ -1275,6 +1337,69 @@ namespace Search {
   DEFINE_PARAM_B(lol0, 81, 0, 150);
   DEFINE_PARAM_B(lol1, 150,   75,  225);
 
+  void Thread::reusePrevSearch(Position& rootPos) {
+    const Thread* main = Threads::mainThread();
+
+    for (int ply = 0; ply <= ReuseMaxPly && ply < main->prevPvLength; ply += 2) {
+      if (main->prevPvKeys[ply] != rootPos.key)
+        continue;
+
+      const int idx = rootMoves.indexOf(main->prevPv[ply]);
+      if (idx < 0)
+        return;
+
+      // The predicted move goes first with the last score, which centers the first aspiration
+      // window. The others rank below it until searched
+      for (int i = 0; i < rootMoves.size(); i++)
+        rootMoves[i].score = -SCORE_INFINITE;
+
+      std::swap(rootMoves[0], rootMoves[idx]);
+      RootMove& rm = rootMoves[0];
+      rm.score = rm.averageScore = main->searchPrevScore;
+      rm.pvLength = main->prevPvLength - ply;
+      for (int i = 0; i < rm.pvLength; i++)
+        rm.pv[i] = main->prevPv[ply + i];
+      return;
+    }
+  }
+
+  // The published total lags by less than NodesPublishPeriod per thread. Alone, or with less than
+  // that left, count exactly. In deterministic mode, the published total is what keeps it reproducible
+  bool Thread::nodesLimitReached(uint64_t limit) {
+    if (!limit)
+      return false;
+
+    const uint64_t threads = Threads::searchThreads.size();
+    if (threads == 1)
+      return nodesSearched.get() >= limit;
+
+    const uint64_t published = Threads::publishedNodes();
+    if (published >= limit)
+      return true;
+
+    if (Threads::isDeterministic() || limit - published >= threads * NodesPublishPeriod)
+      return false;
+
+    return Threads::totalNodes() >= limit;
+  }
+
+  void Thread::savePv(const Position& rootPos, const RootMove& rm, int depth) {
+    prevPvLength = 0;
+
+    if (!depth || rm.move != rm.pv[0] || rm.score == -SCORE_INFINITE)
+      return;
+
+    Position pos = rootPos;
+    for (int i = 0; i < rm.pvLength && i <= ReuseMaxPly; i++) {
+      prevPv[i] = rm.pv[i];
+      prevPvKeys[i] = pos.key;
+      prevPvLength++;
+
+      DirtyPieces dirtyPieces;
+      pos.doMove(rm.pv[i], dirtyPieces);
+    }
+  }
+
   void Thread::startSearch() {
 
     const Settings& settings = Threads::getSearchSettings();
@@ -1307,6 +1432,12 @@ namespace Search {
     ply = 0;
     maxTimeCounter = 0;
 
+    const bool isHelper = this != Threads::mainThread();
+    skipDepths = isHelper && UCI::Options["SMP Depth Skip"];
+    aspOffset = isHelper ? int(UCI::Options["SMP Asp Offset"]) * (index % 2 ? 1 : -1) : 0;
+    rootNoise = isHelper ? int(UCI::Options["SMP Root Noise"]) : 0;
+    rootNoiseSeed = (uint64_t(int(UCI::Options["SMP Seed"])) << 32) ^ index;
+
     // Setup search stack
 
     SearchInfo* ss = &searchStack[SsOffset];
@@ -1368,12 +1499,20 @@ namespace Search {
 
     const int multiPV = std::min(int(UCI::Options["MultiPV"]), rootMoves.size());
 
+    reusePrevSearch(rootPos);
+
     for (rootDepth = 1; rootDepth <= settings.depth; rootDepth++) {
 
       // Only one legal move? For analysis purposes search, but with a limited depth
       if (hasNormalTM && rootMoves.size() == 1 && elapsedTime() >= 200)
         break;
 
+      if (skipDepths && rootDepth > 1) {
+        const int k = (index - 1) % 20;
+        if ((rootDepth + SkipPhase[k]) / SkipSize[k] % 2)
+          continue;
+      }
+
       for (pvIdx = 0; pvIdx < multiPV; pvIdx++) {
         int avgScore = rootMoves[0].averageScore;
         int window = AspWindowStartDelta + avgScore * avgScore / 13000;
@@ -1382,8 +1521,10 @@ namespace Search {
         int failHighCount = 0;
 
         if (rootDepth >= AspWindowStartDepth) {
-          alpha = std::max(-SCORE_INFINITE, rootMoves[pvIdx].score - window);
-          beta  = std::min( SCORE_INFINITE, rootMoves[pvIdx].score + window);
+          // Helpers may center their window a bit above or below the last score
+          const int center = rootMoves[pvIdx].score + aspOffset;
+          alpha = std::max(-SCORE_INFINITE, center - window);
+          beta  = std::min( SCORE_INFINITE, center + window);
         }
 
         while (true) {
@@ -1416,7 +1557,7 @@ namespace Search {
           else
             break;
 
-          if (settings.nodes && Threads::totalNodes() >= settings.nodes) {
+          if (nodesLimitReached(settings.nodes)) {
             naturalExit = false;
             goto bestMoveDecided;
           }
@@ -1429,7 +1570,7 @@ namespace Search {
 
       completeDepth = rootDepth;
 
-      if (settings.nodes && Threads::totalNodes() >= settings.nodes) {
+      if (nodesLimitReached(settings.nodes)) {
         naturalExit = false;
         goto bestMoveDecided;
       }
@@ -1443,7 +1584,10 @@ namespace Search {
         for (int i = 0; i < multiPV; i++)
           printInfo(completeDepth, i+1, rootMoves[i].score, getPvString(rootMoves[i]));
 
-      if (elapsedTime() >= maxTime)
+      // While pondering, keep deepening. The tests are done again after ponderhit
+      const bool pondering = Threads::isPondering();
+
+      if (elapsedTime() >= maxTime && !pondering)
         goto bestMoveDecided;
 
       const Move bestMove = rootMoves[0].move;
@@ -1454,9 +1598,9 @@ namespace Search {
       else
         searchStability = 0;
 
-      if (hasNormalTM && rootDepth >= 4) {
+      if (hasNormalTM && rootDepth >= 4 && !pondering) {
         int bmNodes = rootMoves[0].nodes;
-        double notBestNodes = 1.0 - (bmNodes / double(nodesSearched));
+        double notBestNodes = 1.0 - (bmNodes / double(nodesSearched.get()));
         double nodesFactor     = (tm1/100.0) + notBestNodes * (tm0/100.0);
 
         double stabilityFactor = (tm2/100.0) - searchStability * (tm3/100.0);
@@ -1477,11 +1621,21 @@ namespace Search {
 
   bestMoveDecided:
 
+    // Publish the rest, so that the total is exact once all threads are here
+    Threads::publishNodes(nodesSearched.get() % NodesPublishPeriod);
+
+    // Stop before leaving the quanta, so that in deterministic mode the other threads see it
+    // at the first quantum without us, whatever the timing
+    if (this == Threads::mainThread()) {
+      Threads::waitForPonderEnd();
+      Threads::stopSearch();
+    }
+
+    Threads::leaveQuanta();
+
     if (this != Threads::mainThread())
       return;
 
-    Threads::stopSearch();
-
     Threads::waitForSearch(false);
 
     Search::Thread* bestThread = this;
@@ -1531,24 +1685,43 @@ namespace Search {
     searchPrevScore = bestThread->rootMoves[0].score;
 
     if (tbBestMove && std::abs(searchPrevScore) < SCORE_MATE_IN_MAX_PLY)
-      printBestMove(tbBestMove);
+      bestMove = tbBestMove;
     else
-      printBestMove(bestThread->rootMoves[0].move);
+      bestMove = bestThread->rootMoves[0].move;
+
+    // The expected reply, for the GUI to send go ponder with
+    const RootMove& bestRm = bestThread->rootMoves[0];
+    Move ponderMove = MOVE_NONE;
+    if (bestMove == bestRm.move && bestRm.pvLength > 1)
+      ponderMove = bestRm.pv[1];
+
+    savePv(rootPos, bestRm, bestThread->completeDepth);
+
+    printBestMove(bestMove, ponderMove);
   }
 
   void Thread::idleLoop() {
+    TT::setThreadStats(&ttStats);
+    TT::setThreadOverlay(&ttOverlay);
+
+    // Read before reporting ready, or a wake up right after it could be missed
+    uint64_t seenWakeUp = Threads::wakeUpCount();
+    Threads::notifyDone();
+
     while (true) {
-      std::unique_lock lock(mutex);
-      cv.wait(lock, [&] { return searching; });
+      Threads::waitForWakeUp(seenWakeUp);
 
       if (exitThread)
           return;
 
-   // searching = true; (already done by the UCI thread)
-      startSearch();
-      searching = false;
+      if (task) {
+        task();
+        task = nullptr;
+      }
+      else
+        startSearch();
 
-      cv.notify_all();
+      Threads::notifyDone();
     }
   }
 }
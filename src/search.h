@@ -3,9 +3,11 @@
 #include "history.h"
 #include "nnue.h"
 #include "position.h"
+#include "tt.h"
 #include "types.h"
 
-#include <condition_variable>
+#include <atomic>
+#include <functional>
 #include <vector>
 
 namespace Search {
@@ -16,6 +18,9 @@ namespace Search {
     int movestogo, depth;
     uint64_t nodes;
 
+    // go ponder: search the position after the expected reply until ponderhit or stop
+    bool ponder;
+
     Position position;
 
     std::vector<uint64_t> prevPositions;
@@ -47,19 +52,54 @@ namespace Search {
   // it's easier to determine conthist score, improving, ...
   constexpr int SsOffset = 6;
 
+  // Written only by its own thread, read by others. It has a cache line to itself, so that the
+  // reads don't bounce the owner's hot data, and the owner updates it with a relaxed load and
+  // store, which costs the same as a plain variable
+  struct alignas(64) ThreadCounter {
+
+    inline void increment() {
+      value.store(value.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+    }
+
+    inline uint64_t get() const {
+      return value.load(std::memory_order_relaxed);
+    }
+
+    inline void reset() {
+      value.store(0, std::memory_order_relaxed);
+    }
+
+  private:
+    std::atomic<uint64_t> value{0};
+  };
+
+  // Each thread adds its nodes to the shared total once every this many nodes
+  constexpr uint64_t NodesPublishPeriod = 1024;
+
+  // In deterministic mode, threads wait for each other every this many nodes
+  constexpr uint64_t DeterministicQuantum = 4 * NodesPublishPeriod;
+
   class Thread {
 
   public:
 
-    std::mutex mutex;
-    std::condition_variable cv;
-
-    volatile bool searching = false;
     volatile bool exitThread = false;
 
+    // Position in Threads::searchThreads, 0 being the main thread
+    int index = 0;
+
+    // When set, the next wake up runs this instead of a search
+    std::function<void()> task;
+
     volatile int completeDepth;
-    volatile uint64_t nodesSearched;
-    volatile uint64_t tbHits;
+    ThreadCounter nodesSearched;
+    ThreadCounter tbHits;
+
+    TT::Stats ttStats;
+
+    // Move of the last bestmove sent. Only set on the main thread
+    Move bestMove = MOVE_NONE;
+    TT::Overlay ttOverlay;
 
     Thread();
 
@@ -72,6 +112,12 @@ namespace Search {
     int64_t optimumTime, maxTime;
     uint32_t maxTimeCounter;
 
+    // Diversity of the helper threads, from the SMP options. All off for the main thread
+    bool skipDepths;
+    int aspOffset;
+    int rootNoise;
+    uint64_t rootNoiseSeed;
+
     int rootDepth;
 
     int ply = 0;
@@ -87,6 +133,12 @@ namespace Search {
     RootMoveList rootMoves;
     int pvIdx;
 
+    // PV of the last search, and the key before each of its moves. The next search starts from
+    // it when its root is on it. Only kept by the main thread, and reset along with the histories
+    Move prevPv[MAX_PLY];
+    Key prevPvKeys[MAX_PLY];
+    int prevPvLength;
+
     MainHistory mainHistory;
     PawnHistory pawnHistory;
     CaptureHistory captureHistory;
@@ -105,6 +157,8 @@ namespace Search {
 
     void updateAccumulator(Position& pos, NNUE::Accumulator& acc);
 
+    void updateAccumulator(Position& pos, NNUE::Accumulator& acc, Color side);
+
     Score doEvaluation(Position& position);
 
     void sortRootMoves(int offset);
@@ -141,10 +195,19 @@ namespace Search {
       bool cutNode, SearchInfo* ss, const Move excludedMove = MOVE_NONE);
 
     void startSearch();
+
+    // When the root was predicted by the last PV, order and score the root moves from it
+    void reusePrevSearch(Position& rootPos);
+
+    void savePv(const Position& rootPos, const RootMove& rm, int depth);
+
+    // Whether the go nodes limit is reached
+    bool nodesLimitReached(uint64_t limit);
   };
 
+  // Count the leaves at this depth. Gives up, returning a partial count, once 'stop' is set
   template<bool root>
-  int64_t perft(Position& pos, int depth);
+  int64_t perft(Position& pos, int depth, const std::atomic<bool>& stop);
 
   void initLmrTable();
 
@@ -4,9 +4,43 @@
 #include <cstdint>
 #include <immintrin.h>
 
+#define SIMD_SSSE3  1
+#define SIMD_AVX2   2
+#define SIMD_AVX512 3
+
+// The instruction set the vectors below are made of. The NNUE kernel files of a dispatch build
+// define it along with a target pragma, since the pragma doesn't define the compiler macros.
+// Otherwise it follows the compiler flags
+#if !defined(SIMD_ARCH)
+#  if defined(__AVX512F__) && defined(__AVX512BW__)
+#    define SIMD_ARCH SIMD_AVX512
+#  elif defined(__AVX2__)
+#    define SIMD_ARCH SIMD_AVX2
+#  elif defined(__SSSE3__)
+#    define SIMD_ARCH SIMD_SSSE3
+#  endif
+#endif
+
+// Whether dpbusd is a single instruction: AVX-512 VNNI with AVX-512, AVX-VNNI with AVX2.
+// Like SIMD_ARCH, defined by the kernel files of a dispatch build
+#if !defined(SIMD_VNNI)
+#  if (SIMD_ARCH == SIMD_AVX512 && defined(__AVX512VNNI__)) || (SIMD_ARCH == SIMD_AVX2 && defined(__AVXVNNI__))
+#    define SIMD_VNNI 1
+#  else
+#    define SIMD_VNNI 0
+#  endif
+#endif
+
 namespace SIMD {
 
-#if defined(__AVX512F__) && defined(__AVX512BW__)
+  // One inline namespace per instruction set, so that the inline functions of different files
+  // of a dispatch build don't get merged by the linker
+#if SIMD_ARCH == SIMD_AVX512
+#if SIMD_VNNI
+  inline namespace Avx512Vnni {
+#else
+  inline namespace Avx512 {
+#endif
 
   using VecI = __m512i;
   using VecF = __m512;
@@ -63,7 +97,12 @@ namespace SIMD {
     return _mm512_reduce_add_ps(vec);
   }
 
-#elif defined(__AVX2__)
+#elif SIMD_ARCH == SIMD_AVX2
+#if SIMD_VNNI
+  inline namespace Avx2Vnni {
+#else
+  inline namespace Avx2 {
+#endif
 
   using VecI = __m256i;
   using VecF = __m256;
@@ -131,7 +170,8 @@ namespace SIMD {
     return _mm_cvtss_f32(sum_32);
   }
 
-#elif defined(__SSSE3__)
+#elif SIMD_ARCH == SIMD_SSSE3
+  inline namespace Ssse3 {
 
   using VecI = __m128i;
   using VecF = __m128;
@@ -201,10 +241,19 @@ namespace SIMD {
 
   constexpr int Alignment = sizeof(VecI);
 
+  // sum + the dot products of each 4 uint8 of x with the 4 int8 of y at the same place.
+  // Emulated, the pairs are first added into int16 with saturation, which VNNI doesn't do
   inline VecI dpbusdEpi32(VecI sum, VecI x, VecI y) {
+#if SIMD_VNNI && SIMD_ARCH == SIMD_AVX512
+    return _mm512_dpbusd_epi32(sum, x, y);
+#elif SIMD_VNNI && SIMD_ARCH == SIMD_AVX2
+    return _mm256_dpbusd_avx_epi32(sum, x, y);
+#else
     VecI prod16 = maddubsEpi16(x, y);
     VecI prod32 = maddEpi16(prod16, set1Epi16(1));
     return addEpi32(sum, prod32);
+#endif
   }
 
+  } // inline namespace
 }
\ No newline at end of file
@@ -1,15 +1,41 @@
 #include "threads.h"
 #include "nnue.h"
+#include "numa.h"
+#include "output.h"
+#include "tt.h"
+#include "uci.h"
+#include "util.h"
 #include <atomic>
+#include <condition_variable>
+#include <mutex>
+#include <new>
 
 namespace Threads {
 
   Search::Settings searchSettings;
 
+  std::mutex quantumMutex;
+  std::condition_variable quantumCv;
+  uint64_t quantumCount = 0; // Guarded by quantumMutex, like the two below
+  int quantumActive, quantumArrived;
+
   std::vector<std::thread*> stdThreads;
   std::vector<Search::Thread*> searchThreads;
 
-  std::atomic<bool> searchStopped;
+  // Each Search::Thread, with its histories and finny table, takes a few MB. It gets a block of
+  // its own, huge pages if allowed, so that its random accesses don't miss the TLB as much
+  std::vector<Util::PageType> threadPages;
+  bool threadLargePages;
+
+  // What the search threads check, and what stopSearch asked for. They only differ in
+  // deterministic mode, where the request is seen at the next quantum
+  std::atomic<bool> searchStopped, stopRequested;
+
+  bool deterministic = false;
+
+  std::mutex ponderMutex;
+  std::condition_variable ponderCv;
+  std::atomic<bool> pondering(false);
 
   Search::Thread* mainThread() {
     return searchThreads[0];
@@ -19,46 +45,98 @@ namespace Threads {
     return searchStopped.load(std::memory_order_relaxed);
   }
 
+  // On its own cache line, as all threads add to it
+  alignas(64) std::atomic<uint64_t> nodesPublished;
+
   uint64_t totalNodes() {
     uint64_t result = 0;
     for (int i = 0; i < searchThreads.size(); i++)
-      result += searchThreads[i]->nodesSearched;
+      result += searchThreads[i]->nodesSearched.get();
     return result;
   }
 
+  uint64_t nodesAtQuantum;
+
+  uint64_t publishedNodes() {
+    if (deterministic)
+      return nodesAtQuantum;
+    return nodesPublished.load(std::memory_order_relaxed);
+  }
+
+  void publishNodes(uint64_t nodes) {
+    nodesPublished.fetch_add(nodes, std::memory_order_relaxed);
+  }
+
   uint64_t totalTbHits() {
     uint64_t result = 0;
     for (int i = 0; i < searchThreads.size(); i++)
-      result += searchThreads[i]->tbHits;
+      result += searchThreads[i]->tbHits.get();
     return result;
   }
 
+  // The pool is woken up as a whole: the search threads sleep on a single condition
+  // variable, and one notify_all starts all of them. They count themselves out on
+  // another one when done, so waiting doesn't go through each thread in turn
+  std::mutex poolMutex;
+  std::condition_variable wakeUpCv, doneCv;
+  uint64_t wakeUps = 0; // Guarded by poolMutex, like 'running'
+  int running = 0;
+
+  uint64_t wakeUpCount() {
+    std::lock_guard lock(poolMutex);
+    return wakeUps;
+  }
+
+  void waitForWakeUp(uint64_t& seenWakeUp) {
+    std::unique_lock lock(poolMutex);
+    wakeUpCv.wait(lock, [&] { return wakeUps != seenWakeUp; });
+    seenWakeUp = wakeUps;
+  }
+
+  void notifyDone() {
+    std::lock_guard lock(poolMutex);
+    // Only the last two are waited for: the main thread waits for the helpers
+    if (--running <= 1)
+      doneCv.notify_all();
+  }
+
+  // With waitMain false this must be called by the main thread during its search,
+  // so that the one thread still running is the caller
   void waitForSearch(bool waitMain) {
-    for (int i = !waitMain; i < searchThreads.size(); i++) {
-      Search::Thread* st = searchThreads[i];
-      std::unique_lock lock(st->mutex);
-      st->cv.wait(lock, [&] { return !st->searching; });
+    {
+      std::unique_lock lock(poolMutex);
+      doneCv.wait(lock, [&] { return running <= !waitMain; });
     }
+
+    // Once the search is over, so is its output. What the caller prints comes after bestmove
+    if (waitMain)
+      Output::flush();
   }
 
-  void startSearchSingle(Search::Thread* st) {
-    st->mutex.lock();
-    st->searching = true;
-    st->mutex.unlock();
-    st->cv.notify_all();
+  void wakeUpAll() {
+    {
+      std::lock_guard lock(poolMutex);
+      running = searchThreads.size();
+      wakeUps++;
+    }
+    wakeUpCv.notify_all();
   }
 
   void startSearch(Search::Settings& settings) {
     searchSettings = settings;
-    searchStopped = false;
+    searchStopped = stopRequested = false;
+    pondering = settings.ponder;
+    nodesPublished = 0;
+    nodesAtQuantum = 0;
+    quantumActive = searchThreads.size();
+    quantumArrived = 0;
     for (int i = 0; i < searchThreads.size(); i++) {
       Search::Thread* st = searchThreads[i];
-      st->nodesSearched = 0;
-      st->tbHits = 0;
+      st->nodesSearched.reset();
+      st->tbHits.reset();
       st->completeDepth = 0;
     }
-    for (int i = 0; i < searchThreads.size(); i++)
-      startSearchSingle(searchThreads[i]);
+    wakeUpAll();
   }
 
   Search::Settings& getSearchSettings() {
@@ -66,42 +144,134 @@ namespace Threads {
   }
 
   void stopSearch() {
-    searchStopped = true;
+    stopRequested = true;
+    if (!deterministic)
+      searchStopped = true;
+
+    // Locked, or a main thread about to wait could miss it
+    if (pondering) {
+      std::lock_guard lock(ponderMutex);
+      ponderCv.notify_all();
+    }
+  }
+
+  bool isPondering() {
+    return pondering.load(std::memory_order_relaxed);
+  }
+
+  void ponderhit() {
+    std::lock_guard lock(ponderMutex);
+    pondering = false;
+    ponderCv.notify_all();
+  }
+
+  void waitForPonderEnd() {
+    std::unique_lock lock(ponderMutex);
+    ponderCv.wait(lock, [] { return !pondering || stopRequested; });
+  }
+
+  void setDeterministic(bool enabled) {
+    deterministic = enabled;
+    TT::setDeterministic(enabled);
   }
 
-  std::atomic<int> startedThreadsCount;
+  bool isDeterministic() {
+    return deterministic;
+  }
+
+  // Called with quantumMutex held, by the thread that completes the quantum. Everyone else is
+  // waiting, so this is the only time the shared state changes
+  void endQuantum() {
+    for (int i = 0; i < searchThreads.size(); i++)
+      searchThreads[i]->ttOverlay.commit();
+
+    nodesAtQuantum = totalNodes();
+    searchStopped = stopRequested.load();
+
+    quantumArrived = 0;
+    quantumCount++;
+    quantumCv.notify_all();
+  }
+
+  void quantumBarrier() {
+    std::unique_lock lock(quantumMutex);
+    const uint64_t quantum = quantumCount;
+
+    if (++quantumArrived == quantumActive)
+      endQuantum();
+    else
+      quantumCv.wait(lock, [&] { return quantumCount != quantum; });
+  }
+
+  void leaveQuanta() {
+    if (!deterministic)
+      return;
+
+    // Nothing is written after this, but what was buffered is committed with the next quantum
+    // (or now, if this is the last thread), in thread order as usual
+    std::lock_guard lock(quantumMutex);
+    if (--quantumActive == quantumArrived)
+      endQuantum();
+  }
+
+  void runOnAll(const std::function<void(int)>& job) {
+    waitForSearch();
+
+    if (searchThreads.empty()) {
+      job(0);
+      return;
+    }
+
+    for (int i = 0; i < searchThreads.size(); i++)
+      searchThreads[i]->task = [&job, i] { job(i); };
+
+    wakeUpAll();
+    waitForSearch();
+  }
 
   void threadEntry(int index) {
-    searchThreads[index] = new Search::Thread();
-    startedThreadsCount++;
+    // Bind before allocating, so that the histories are first touched on the local node
+    Numa::bindThisThread(index);
+    void* mem = Util::allocLarge(sizeof(Search::Thread), threadLargePages, threadPages[index]);
+    searchThreads[index] = new (mem) Search::Thread();
+    searchThreads[index]->index = index;
     searchThreads[index]->idleLoop();
   }
 
+  void deleteThread(int index) {
+    searchThreads[index]->~Thread();
+    Util::freeLarge(searchThreads[index], sizeof(Search::Thread), threadPages[index]);
+  }
+
   void setThreadCount(int threadCount) {
     waitForSearch();
 
-    for (int i = 0; i < searchThreads.size(); i++) {
+    for (int i = 0; i < searchThreads.size(); i++)
       searchThreads[i]->exitThread = true;
-      startSearchSingle(searchThreads[i]);
+
+    wakeUpAll();
+
+    for (int i = 0; i < searchThreads.size(); i++) {
       stdThreads[i]->join();
-      delete searchThreads[i];
+      deleteThread(i);
       delete stdThreads[i];
     }
 
     searchThreads.resize(threadCount);
     stdThreads.resize(threadCount);
+    threadPages.resize(threadCount);
+    threadLargePages = UCI::Options["LargePages"];
 
-    startedThreadsCount = 0;
+    // Each thread counts itself out when it enters its idle loop
+    {
+      std::lock_guard lock(poolMutex);
+      running = threadCount;
+    }
 
-     for (int i = 0; i < threadCount; i++) {
+    for (int i = 0; i < threadCount; i++)
       stdThreads[i] = new std::thread(threadEntry, i);
-    }
 
-    while (startedThreadsCount < threadCount) {
-      // This is necessary because some Search::Thread(s) may not be ready yet.
-      // TODO replace this spin with something cleaner
-      // - this will take like a millisecond, all threads are started immediately
-    }
+    waitForSearch();
   }
 
 }
@@ -12,8 +12,15 @@ namespace Threads {
 
   bool isSearchStopped();
 
+  // Exact, but reads a counter of each thread
   uint64_t totalNodes();
 
+  // Total nodes as published by the threads, behind by less than NodesPublishPeriod per thread.
+  // Meant for the hot limit checks, info output uses totalNodes(). Exact once the search is over
+  uint64_t publishedNodes();
+
+  void publishNodes(uint64_t nodes);
+
   uint64_t totalTbHits();
 
   void waitForSearch(bool waitMain = true);
@@ -24,5 +31,39 @@ namespace Threads {
 
   void stopSearch();
 
+  // Set by go ponder until ponderhit. Meanwhile the main thread doesn't stop for time,
+  // but the time it spends counts once ponderhit turns the search into a normal one
+  bool isPondering();
+
+  void ponderhit();
+
+  // Called by the main thread when its search is over: bestmove can't be sent while pondering,
+  // so wait for ponderhit or stop
+  void waitForPonderEnd();
+
+  // Deterministic mode makes searches with a node or depth limit reproducible for a given
+  // thread count. Threads wait for each other every Search::DeterministicQuantum nodes, and only
+  // then do they see each other's TT writes, the nodes searched, and stop requests
+  void setDeterministic(bool enabled);
+
+  bool isDeterministic();
+
+  // Called by a search thread at each quantum, and once when its search is over
+  void quantumBarrier();
+
+  void leaveQuanta();
+
+  // Run job(index) on each search thread and wait until all are done.
+  // Threads are bound to their NUMA node, so memory they touch first is local to them
+  void runOnAll(const std::function<void(int)>& job);
+
   void setThreadCount(int threadCount);
+
+  // Used by the search threads: sleep until the pool is woken up again after 'seenWakeUp',
+  // then report when the work is done
+  uint64_t wakeUpCount();
+
+  void waitForWakeUp(uint64_t& seenWakeUp);
+
+  void notifyDone();
 }
\ No newline at end of file
@@ -1,7 +1,13 @@
 #include "tt.h"
+#include "threads.h"
 #include "uci.h"
 #include "util.h"
 
+#include <atomic>
+#include <climits>
+#include <fstream>
+#include <iomanip>
+#include <sstream>
 #include <vector>
 
 namespace TT {
@@ -9,124 +15,704 @@ namespace TT {
   constexpr size_t MEGA = 1024 * 1024;
   constexpr uint8_t MAX_AGE = 1 << 5;
 
+  constexpr uint32_t CheckMask = (1 << CheckBits) - 1;
+
   uint8_t tableAge;
+  uint8_t generationSpan = MAX_AGE - 1; // Searches since the last new generation, at most MAX_AGE-1
   Bucket* buckets = nullptr;
   uint64_t bucketCount;
 
-  void clear() {
-    tableAge = 0;
+  size_t allocatedBytes;
+  Util::PageType pageType;
 
-    const int threadCount = UCI::Options["Threads"];
-    const uint64_t chunkSize = bucketCount / threadCount;
+  // Layout of hash files, both for savehash/loadhash and for the HashFile mapping.
+  // The buckets follow the header, at offset HeaderSize
+  struct FileHeader {
+    uint64_t magic;
+    uint32_t version;
+    uint32_t bucketSize;
+    uint32_t entriesPerBucket;
+    uint32_t tableAge;
+    uint64_t bucketCount;
+  };
 
-    std::vector<std::thread> threads;
-    threads.reserve(threadCount);
-    for (int i = 0; i < threadCount; ++i)
-    {
-      threads.emplace_back([chunkSize, i]
-      {
-        memset(&buckets[chunkSize * i], 0, chunkSize * sizeof(Bucket));
-      });
+  constexpr uint64_t FileMagic = 0x54544E4149444953; // "SIDIANTT"
+  constexpr uint32_t FileVersion = 2;
+  constexpr size_t HeaderSize = 4096;
+
+  std::string hashFile;
+  FileHeader* fileHeader = nullptr; // Non null when the buckets are mapped to hashFile
+
+  // How much of the table transparent huge pages back, as verified by the last resize
+  size_t hugeBytes = 0;
+
+  bool wideKeys = false;
+  std::atomic<uint64_t> collisions;
+
+  Stats noStats;
+  thread_local Stats* threadStats = &noStats;
+
+  bool deterministic = false;
+  thread_local Overlay* threadOverlay = nullptr;
+
+  // The qsearch table of a search thread. It is (re)allocated by its own thread on first use,
+  // so that it's local to its node, and freed when the thread exits. It's small, so it gets
+  // exactly its size, rather than being rounded up to huge pages
+  struct QsTable {
+    Bucket* buckets = nullptr;
+    uint64_t bucketCount = 0;
+
+    ~QsTable() {
+      _mm_free(buckets);
     }
 
-    const uint64_t cleared = threadCount * chunkSize;
-    if (cleared < bucketCount)
-      memset(&buckets[cleared], 0, (bucketCount - cleared) * sizeof(Bucket));
+    bool contains(const Entry* entry) const {
+      return (const void*) entry >= buckets && (const void*) entry < buckets + bucketCount;
+    }
+  };
+
+  uint64_t qsBucketCount = 0;
+  thread_local QsTable qsTable;
+
+  FileHeader makeHeader() {
+    FileHeader header;
+    header.magic = FileMagic;
+    header.version = FileVersion;
+    header.bucketSize = sizeof(Bucket);
+    header.entriesPerBucket = EntriesPerBucket;
+    header.tableAge = tableAge;
+    header.bucketCount = bucketCount;
+    return header;
+  }
+
+  // Whether buckets saved with this header can be used by this build
+  bool isCompatible(const FileHeader& header) {
+    return header.magic == FileMagic
+        && header.version == FileVersion
+        && header.bucketSize == sizeof(Bucket)
+        && header.entriesPerBucket == EntriesPerBucket
+        && header.tableAge < MAX_AGE;
+  }
+
+  void setTableAge(uint8_t age) {
+    tableAge = age;
+    if (fileHeader)
+      fileHeader->tableAge = age;
+  }
+
+  // Split [0, count) in one range per search thread, and run job(begin, end) for each
+  // range on that thread. Pages are first touched there, so each range ends up on its node
+  template<typename Job>
+  void forEachRange(uint64_t count, const Job& job) {
+    const int threadCount = std::max<int>(1, Threads::searchThreads.size());
+
+    Threads::runOnAll([&](int i) {
+      job(count * i / threadCount, count * (i + 1) / threadCount);
+    });
+  }
+
+  void clearBuckets() {
+    forEachRange(bucketCount, [](uint64_t begin, uint64_t end) {
+      memset(&buckets[begin], 0, (end - begin) * sizeof(Bucket));
+      if (qsTable.buckets)
+        memset(qsTable.buckets, 0, qsTable.bucketCount * sizeof(Bucket));
+    });
+  }
+
+  void clear() {
+    setTableAge(0);
+    generationSpan = MAX_AGE - 1;
+    clearBuckets();
+  }
 
-    for (auto &thread : threads)
-      thread.join();
+  void newGeneration() {
+    // The age is advanced too, or the last search would still be part of the generation
+    setTableAge((tableAge+1) % MAX_AGE);
+    generationSpan = 0;
   }
 
   void nextSearch() {
-    tableAge = (tableAge+1) % MAX_AGE;
+    setTableAge((tableAge+1) % MAX_AGE);
+    generationSpan = std::min(generationSpan + 1, MAX_AGE - 1);
   }
 
-  void resize(size_t megaBytes) {
-    if (buckets)
-      Util::freeAlign(buckets);
+  bool mapHashFile() {
+    size_t previousSize;
+    void* base = Util::mapFileShared(hashFile, HeaderSize + allocatedBytes, previousSize);
+    if (!base) {
+      std::cout << "info string Could not map hash file " << hashFile << ", using memory" << std::endl;
+      return false;
+    }
+
+    fileHeader = (FileHeader*) base;
+    buckets = (Bucket*) ((char*) base + HeaderSize);
+
+    if ( previousSize == HeaderSize + allocatedBytes
+      && isCompatible(*fileHeader)
+      && fileHeader->bucketCount == bucketCount)
+    {
+      tableAge = fileHeader->tableAge;
+      generationSpan = MAX_AGE - 1;
+      std::cout << "info string Hash: resumed " << allocatedBytes / MEGA << " MB from " << hashFile << std::endl;
+    }
+    else {
+      *fileHeader = makeHeader();
+      clear();
+      std::cout << "info string Hash: " << allocatedBytes / MEGA << " MB mapped to " << hashFile << std::endl;
+    }
+    return true;
+  }
+
+  void release() {
+    if (fileHeader)
+      Util::unmapFile(fileHeader, HeaderSize + allocatedBytes);
+    else
+      Util::freeLarge(buckets, allocatedBytes, pageType);
+
+    fileHeader = nullptr;
+    buckets = nullptr;
+  }
+
+  uint64_t rehash(Bucket* oldBuckets, uint64_t oldCount, uint64_t& dropped);
+
+  void resize(size_t megaBytes, bool report) {
+    Bucket* oldBuckets = buckets;
+    const uint64_t oldCount = bucketCount;
+    const size_t oldBytes = allocatedBytes;
+    const Util::PageType oldPageType = pageType;
+
+    // A table in memory is moved to the new one instead of being discarded
+    const bool rehashing = buckets && !fileHeader && hashFile.empty();
+    if (!rehashing)
+      release();
+
+    allocatedBytes = megaBytes * MEGA;
+    bucketCount = allocatedBytes / sizeof(Bucket);
+
+    if (!hashFile.empty() && mapHashFile())
+      return;
+
+    buckets = (Bucket*) Util::allocLarge(allocatedBytes, UCI::Options["LargePages"], pageType);
 
-    size_t bytes = megaBytes * MEGA;
-    bucketCount = bytes / sizeof(Bucket);
+    uint64_t kept = 0, dropped = 0;
+    if (rehashing) {
+      clearBuckets();
+      kept = rehash(oldBuckets, oldCount, dropped);
+      Util::freeLarge(oldBuckets, oldBytes, oldPageType);
+    }
+    else
+      clear();
+
+    // madvise succeeding doesn't mean we got huge pages. Now that the table is touched, verify
+    if (pageType == Util::PAGES_TRANSPARENT) {
+      hugeBytes = Util::transparentHugeBytes(buckets, allocatedBytes);
+      if (hugeBytes == 0)
+        pageType = Util::PAGES_NORMAL;
+    }
+
+    if (report)
+      std::cout << "info string Hash: " << pagesInfo() << std::endl;
+
+    // Only worth a line when the old table had something in it
+    if (report && kept + dropped)
+      std::cout << "info string Hash: kept " << kept << " entries, dropped "
+                << dropped << " whose new bucket isn't known" << std::endl;
+  }
 
-    buckets = (Bucket*) Util::allocAlign(bytes);
-    
-    clear();
+  std::string pagesInfo() {
+    std::ostringstream ss;
+    ss << allocatedBytes / MEGA;
+    if (fileHeader)
+      ss << " MB mapped to " << hashFile;
+    else if (pageType == Util::PAGES_TRANSPARENT && hugeBytes < allocatedBytes)
+      ss << " MB, " << hugeBytes / MEGA << " MB of it backed by transparent huge pages";
+    else
+      ss << " MB in " << Util::pageTypeToString(pageType);
+    return ss.str();
   }
 
-  Bucket* getBucket(Key key) {
+  // The bucket index is the high half of key * bucketCount. The top bits of the low half
+  // are the fraction that was dropped, and they are used as extra key bits
+  Bucket* getBucket(Key key, uint16_t& ext) {
     using uint128 = unsigned __int128;
-    uint64_t index = (uint128(key) * uint128(bucketCount)) >> 64;
-    return & buckets[index];
+    uint128 product = uint128(key) * uint128(bucketCount);
+    ext = uint64_t(product) >> (64 - KeyExtBits);
+    return & buckets[uint64_t(product >> 64)];
+  }
+
+  // Same indexing in the qsearch table, which doesn't use extra key bits
+  inline Bucket* getQsBucket(Key key) {
+    using uint128 = unsigned __int128;
+    return & qsTable.buckets[uint64_t((uint128(key) * uint128(qsTable.bucketCount)) >> 64)];
+  }
+
+  // Make the qsearch table of this thread match the QSearch Hash option. Returns false if
+  // qsearch should use the shared table
+  inline bool hasQsTable() {
+    if (qsTable.bucketCount == qsBucketCount)
+      return qsBucketCount;
+
+    _mm_free(qsTable.buckets);
+    qsTable.buckets = nullptr;
+    qsTable.bucketCount = qsBucketCount;
+    if (qsBucketCount) {
+      qsTable.buckets = (Bucket*) _mm_malloc(qsBucketCount * sizeof(Bucket), 64);
+      memset(qsTable.buckets, 0, qsBucketCount * sizeof(Bucket));
+    }
+    return qsBucketCount;
   }
 
   void prefetch(Key key) {
-    __builtin_prefetch(getBucket(key));
+    uint16_t ext;
+    __builtin_prefetch(getBucket(key, ext));
+  }
+
+  int qualityOf(const EntryData& e) {
+    if (e.isStale())
+      return INT_MIN;
+    return e.getDepth() - 8 * e.getAgeDistance();
+  }
+
+  inline uint64_t wordOf(const EntryData& data) {
+    uint64_t word;
+    memcpy(&word, &data, sizeof(word));
+    return word;
+  }
+
+  // Place an entry in the bucket, over an empty or lower quality entry.
+  // Returns 1 if it took an empty slot, so that the caller can count the entries
+  int insert(Bucket* bucket, const EntryData& data, uint32_t check) {
+    int target = -1;
+    int worstQuality = qualityOf(data);
+
+    for (int i = 0; i < EntriesPerBucket; i++) {
+      EntryData other = bucket->entries[i].load();
+      if (other.isEmpty()) {
+        bucket->entries[i].write(wordOf(data), check);
+        return 1;
+      }
+      if (qualityOf(other) < worstQuality) {
+        worstQuality = qualityOf(other);
+        target = i;
+      }
+    }
+
+    if (target >= 0)
+      bucket->entries[target].write(wordOf(data), check);
+    return 0;
   }
 
-  int qualityOf(Entry* e) {
-    return e->getDepth() - 8 * e->getAgeDistance();
+  // Move the entries of the old table to the current (cleared) one. We don't have the keys,
+  // but the bucket index and the extra key bits together tell where the key falls in [0, 1),
+  // to within 2^-KeyExtBits of an old bucket (a whole one if the bits are unknown). Entries
+  // whose interval spans two new buckets are dropped, as are the extra bits of those whose
+  // interval spans more than one value of them. Each thread fills its own range of new buckets,
+  // so they never write to the same bucket, and when entries compete the deepest and youngest win
+  uint64_t rehash(Bucket* oldBuckets, uint64_t oldCount, uint64_t& dropped) {
+    using uint128 = unsigned __int128;
+    constexpr uint64_t ExtValues = 1 << KeyExtBits;
+
+    std::atomic<uint64_t> kept(0), droppedTotal(0);
+
+    forEachRange(bucketCount, [&](uint64_t begin, uint64_t end) {
+      const uint64_t oldBegin = uint128(begin) * oldCount / bucketCount;
+      const uint64_t oldEnd = std::min<uint64_t>(oldCount, uint128(end) * oldCount / bucketCount + 1);
+      uint64_t keptHere = 0, droppedHere = 0;
+
+      for (uint64_t i = oldBegin; i < oldEnd; i++) {
+        Bucket* oldBucket = &oldBuckets[i];
+
+        for (int j = 0; j < EntriesPerBucket; j++) {
+          EntryData data = oldBucket->entries[j].load();
+          if (data.isEmpty())
+            continue;
+
+          // The interval of the key, in units of 2^-KeyExtBits old buckets, then the first and
+          // last unit of new buckets it touches
+          const uint32_t check = oldBucket->loadCheck(j);
+          const uint16_t oldExt = Entry::keyExtOf(check);
+          const uint128 from = uint128(i) * ExtValues + (oldExt == KeyExtUnknown ? 0 : oldExt);
+          const uint128 to = oldExt == KeyExtUnknown ? from + ExtValues : from + 1;
+
+          const uint64_t first = from * bucketCount / oldCount;
+          const uint64_t last = (to * bucketCount - 1) / oldCount;
+          const uint64_t index = first / ExtValues;
+
+          if (index < begin || index >= end)
+            continue;
+
+          if (last / ExtValues != index) {
+            droppedHere++;
+            continue;
+          }
+
+          const uint16_t ext = first == last ? first % ExtValues : KeyExtUnknown;
+          keptHere += insert(&buckets[index], data, (check & 0xFFFF) | uint32_t(ext) << 16);
+        }
+      }
+
+      kept += keptHere;
+      droppedTotal += droppedHere;
+    });
+
+    dropped = droppedTotal;
+    return kept;
+  }
+
+  void prefetchQs(Key key) {
+    if (hasQsTable())
+      __builtin_prefetch(getQsBucket(key));
+    else
+      prefetch(key);
   }
 
-  Entry* probe(Key key, bool& hit) {
+  Entry* probeBucket(Bucket* bucket, Key key, bool checkExt, uint16_t ext, bool& hit, EntryData& data) {
 
-    Entry* entries = getBucket(key)->entries;
+    threadStats->probes++;
+
+    Entry* entries = bucket->entries;
 
     for (int i = 0; i < EntriesPerBucket; i++) {
-      if (entries[i].matches(key)) {
-        hit = ! entries[i].isEmpty();
+      data = entries[i].load();
+      const uint32_t check = entries[i].loadCheck();
+      if (Entry::matches(key, data, check)) {
+        const uint16_t entryExt = Entry::keyExtOf(check);
+        if (checkExt && entryExt != KeyExtUnknown && entryExt != ext && !data.isEmpty()) {
+          collisions.fetch_add(1, std::memory_order_relaxed);
+          if (wideKeys)
+            continue;
+        }
+        hit = ! data.isEmpty();
+        threadStats->hits += hit;
         return & entries[i];
       }
     }
 
     Entry* worstEntry = & entries[0];
+    int worstQuality = qualityOf(entries[0].load());
 
     for (int i = 1; i < EntriesPerBucket; i++) {
-      if (qualityOf(& entries[i]) < qualityOf(worstEntry))
+      int quality = qualityOf(entries[i].load());
+      if (quality < worstQuality) {
         worstEntry = & entries[i];
+        worstQuality = quality;
+      }
     }
 
     hit = false;
     return worstEntry;
   }
 
+  Entry* probe(Key key, bool& hit, EntryData& data) {
+    uint16_t ext;
+    Bucket* bucket = getBucket(key, ext);
+
+    if (deterministic && threadOverlay) {
+      bucket = threadOverlay->get(bucket - buckets);
+
+      // When full, hand out an empty bucket that is thrown away. This depends only on what the
+      // thread did in this quantum, so the search stays reproducible
+      alignas(sizeof(Bucket)) static thread_local Bucket scratch;
+      if (!bucket) {
+        memset(&scratch, 0, sizeof(Bucket));
+        bucket = &scratch;
+      }
+    }
+
+    return probeBucket(bucket, key, true, ext, hit, data);
+  }
+
+  Entry* probeQs(Key key, bool& hit, EntryData& data) {
+    if (!hasQsTable())
+      return probe(key, hit, data);
+    return probeBucket(getQsBucket(key), key, false, 0, hit, data);
+  }
+
+  void setQsTableSize(size_t kiloBytes) {
+    qsBucketCount = kiloBytes * 1024 / sizeof(Bucket);
+  }
+
   int hashfull() {
     int entryCount = 0;
     for (int i = 0; i < 1000; i++) {
+      Bucket* bucket = &buckets[i * bucketCount / 1000];
       for (int j = 0; j < EntriesPerBucket; j++) {
-        Entry* entry = & buckets[i].entries[j];
-        if (entry->getAge() == tableAge && !entry->isEmpty())
+        EntryData entry = bucket->entries[j].load();
+        if (entry.getAge() == tableAge && !entry.isEmpty())
           entryCount++;
       }
     }
     return entryCount / EntriesPerBucket;
   }
 
-  int Entry::getAgeDistance() {
+  void setFile(const std::string& path) {
+    hashFile = path;
+  }
+
+  size_t fileMegaBytes(const std::string& path) {
+    std::ifstream file(path, std::ios::binary);
+    FileHeader header;
+    if (!file.read((char*) &header, sizeof(header)) || !isCompatible(header))
+      return 0;
+    return header.bucketCount * sizeof(Bucket) / MEGA;
+  }
+
+  bool save(const std::string& path) {
+    std::ofstream file(path, std::ios::binary);
+    FileHeader header = makeHeader();
+    std::vector<char> padding(HeaderSize - sizeof(header), 0);
+
+    file.write((char*) &header, sizeof(header));
+    file.write(padding.data(), padding.size());
+    file.write((char*) buckets, bucketCount * sizeof(Bucket));
+    return bool(file);
+  }
+
+  bool load(const std::string& path) {
+    const size_t megaBytes = fileMegaBytes(path);
+    if (!megaBytes)
+      return false;
+
+    // Adopt the size of the saved table. This goes through the Hash option, so that it stays in sync.
+    // The file replaces the contents, so release the table first rather than have resize rehash it
+    if (megaBytes * MEGA != allocatedBytes) {
+      UCI::Option& hash = UCI::Options["Hash"];
+      if (megaBytes < size_t(hash.minValue()) || megaBytes > size_t(hash.maxValue()))
+        return false;
+
+      release();
+      hash.set(std::to_string(megaBytes));
+    }
+
+    std::ifstream file(path, std::ios::binary);
+    FileHeader header;
+    file.read((char*) &header, sizeof(header));
+    file.seekg(HeaderSize);
+
+    if (!file.read((char*) buckets, bucketCount * sizeof(Bucket))) {
+      clear();
+      return false;
+    }
+
+    setTableAge(header.tableAge);
+    generationSpan = MAX_AGE - 1;
+    return true;
+  }
+
+  void setThreadStats(Stats* stats) {
+    threadStats = stats;
+  }
+
+  void setThreadOverlay(Overlay* overlay) {
+    threadOverlay = overlay;
+  }
+
+  void setDeterministic(bool enabled) {
+    deterministic = enabled;
+  }
+
+  Overlay::~Overlay() {
+    Util::freeAlign(copies);
+    Util::freeAlign(originals);
+    delete[] indices;
+    delete[] epochs;
+    delete[] order;
+  }
+
+  Bucket* Overlay::get(uint64_t index) {
+    if (!copies) {
+      copies = (Bucket*) Util::allocAlign(Capacity * sizeof(Bucket));
+      originals = (Bucket*) Util::allocAlign(Capacity * sizeof(Bucket));
+      indices = new uint64_t[Capacity];
+      epochs = new uint32_t[Capacity]();
+      order = new uint32_t[Capacity];
+    }
+
+    // Open addressing, with linear probing
+    uint32_t slot = (index * 0x9E3779B97F4A7C15ULL) >> (64 - CapacityBits);
+    while (epochs[slot] == epoch) {
+      if (indices[slot] == index)
+        return &copies[slot];
+      slot = (slot + 1) % Capacity;
+    }
+
+    if (used >= Capacity * 3 / 4)
+      return nullptr;
+
+    epochs[slot] = epoch;
+    indices[slot] = index;
+    order[used++] = slot;
+    copies[slot] = originals[slot] = buckets[index];
+    return &copies[slot];
+  }
+
+  bool Overlay::isStale(const Entry* entry, uint64_t index) const {
+    const Bucket* bucket = (const Bucket*) (uintptr_t(entry) & ~uintptr_t(sizeof(Bucket) - 1));
+    if (!copies || bucket < copies || bucket >= copies + Capacity)
+      return false;
+
+    const uint64_t slot = bucket - copies;
+    return epochs[slot] != epoch || indices[slot] != index;
+  }
+
+  void Overlay::commit() {
+    for (uint32_t i = 0; i < used; i++) {
+      const uint32_t slot = order[i];
+      Bucket* copy = &copies[slot];
+      Bucket* original = &originals[slot];
+      Bucket* shared = &buckets[indices[slot]];
+
+      for (int j = 0; j < EntriesPerBucket; j++) {
+        const uint64_t word = wordOf(copy->entries[j].load());
+        const uint32_t check = copy->loadCheck(j);
+        if (word != wordOf(original->entries[j].load()) || check != original->loadCheck(j))
+          shared->entries[j].write(word, check);
+      }
+    }
+
+    used = 0;
+    epoch++;
+  }
+
+  void printStats(const Stats& stats) {
+    constexpr int DepthBins = 7, AgeBins = 5;
+    constexpr int DepthBinMin[DepthBins] = { 0, 1, 4, 8, 12, 16, 24 };
+    constexpr int AgeBinMin[AgeBins] = { 0, 1, 2, 4, 8 };
+    const char* DepthBinName[DepthBins] = { "0", "1-3", "4-7", "8-11", "12-15", "16-23", "24+" };
+    const char* AgeBinName[AgeBins] = { "0", "1", "2-3", "4-7", "8+" };
+
+    uint64_t histogram[DepthBins][AgeBins] = {};
+    uint64_t occupied = 0;
+
+    const uint64_t sampled = std::min<uint64_t>(bucketCount, 1 << 16);
+    for (uint64_t i = 0; i < sampled; i++) {
+      Bucket* bucket = &buckets[i * bucketCount / sampled];
+      for (int j = 0; j < EntriesPerBucket; j++) {
+        EntryData entry = bucket->entries[j].load();
+        if (entry.isEmpty())
+          continue;
+
+        int d = DepthBins - 1, a = AgeBins - 1;
+        while (entry.getDepth() < DepthBinMin[d]) d--;
+        while (entry.getAgeDistance() < AgeBinMin[a]) a--;
+        histogram[d][a]++;
+        occupied++;
+      }
+    }
+
+    auto percent = [](uint64_t part, uint64_t whole) {
+      std::ostringstream ss;
+      ss.precision(1);
+      ss << std::fixed << (whole ? 100.0 * part / whole : 0.0) << "%";
+      return ss.str();
+    };
+
+    const uint64_t sampledEntries = sampled * EntriesPerBucket;
+
+    std::cout << "size:         " << allocatedBytes / MEGA << " MB, " << bucketCount << " buckets of "
+              << EntriesPerBucket << " entries, " << Util::pageTypeToString(pageType) << "\n"
+              << "hashfull:     " << hashfull() << "\n"
+              << "occupied:     " << percent(occupied, sampledEntries) << " of " << sampledEntries << " sampled entries\n"
+              << "probes:       " << stats.probes << ", hits " << percent(stats.hits, stats.probes)
+              << ", cutoffs " << percent(stats.cutoffs, stats.hits) << " of hits\n"
+              << "stores:       " << stats.stores << ", replacements " << percent(stats.replacements, stats.stores) << "\n"
+              << "collisions:   " << rejectedCollisions() << " detected by extra key bits\n"
+              << "occupancy by depth (rows) and age (columns), % of sampled entries:\n"
+              << std::setw(8) << "";
+    for (int a = 0; a < AgeBins; a++)
+      std::cout << std::setw(8) << AgeBinName[a];
+    std::cout << "\n";
+
+    for (int d = 0; d < DepthBins; d++) {
+      std::cout << std::setw(8) << DepthBinName[d];
+      for (int a = 0; a < AgeBins; a++)
+        std::cout << std::setw(8) << percent(histogram[d][a], sampledEntries);
+      std::cout << "\n";
+    }
+    std::cout << std::flush;
+  }
+
+  void setWideKeys(bool enabled) {
+    wideKeys = enabled;
+  }
+
+  uint64_t rejectedCollisions() {
+    return collisions.load(std::memory_order_relaxed);
+  }
+
+  int EntryData::getAgeDistance() const {
     return (MAX_AGE + tableAge - getAge()) % MAX_AGE;
   }
 
+  bool EntryData::isStale() const {
+    return getAgeDistance() > generationSpan;
+  }
+
   void Entry::store(Key _key, Flag _bound, int _depth, Move _move, Score _score, Score _eval, bool isPV, int ply) {
 
-     if (!matches(_key) || _move)
-        this->move = _move;
+    if (deterministic && threadOverlay) {
+      uint16_t ext;
+      if (threadOverlay->isStale(this, getBucket(_key, ext) - buckets)) {
+        bool hit;
+        EntryData data;
+        probe(_key, hit, data)->store(_key, _bound, _depth, _move, _score, _eval, isPV, ply);
+        return;
+      }
+    }
+
+    // The extra key bits come from the index in the shared table. The qsearch table doesn't use them
+    uint16_t ext = KeyExtUnknown;
+    if (!qsTable.contains(this))
+      getBucket(_key, ext);
+
+    EntryData d = load();
+    const uint32_t check = loadCheck();
+    const uint16_t entryExt = keyExtOf(check);
+
+    // With wide keys, data stored under other extra bits belongs to another position
+    const bool sameKey = matches(_key, d, check) && !d.isStale()
+                      && (!wideKeys || entryExt == KeyExtUnknown || entryExt == ext);
+
+    threadStats->stores++;
+    threadStats->replacements += !sameKey && !d.isEmpty();
+
+    if (!sameKey || _move)
+      d.move = _move;
 
     if (_score != SCORE_NONE) {
       if (_score >= SCORE_TB_WIN_IN_MAX_PLY)
         _score += ply;
-      else if (score <= SCORE_TB_LOSS_IN_MAX_PLY)
+      else if (d.score <= SCORE_TB_LOSS_IN_MAX_PLY)
         _score -= ply;
     }
 
     if ( _bound == FLAG_EXACT
-      || !matches(_key)
-      || getAgeDistance()
-      || _depth + 4 + 2*isPV > this->depth) {
-
-        this->key16 = (uint16_t) _key;
-        this->depth = _depth;
-        this->score = _score;
-        this->staticEval = _eval;
-        this->agePvBound = _bound | (isPV << 2) | (tableAge << 3);
+      || !sameKey
+      || d.getAgeDistance()
+      || _depth + 4 + 2*isPV > d.depth) {
+
+        d.depth = _depth;
+        d.score = _score;
+        d.staticEval = _eval;
+        d.agePvBound = _bound | (isPV << 2) | (tableAge << 3);
       }
+
+    const uint64_t word = wordOf(d);
+    write(word, makeCheck(_key, word, ext));
+  }
+
+  void Entry::write(uint64_t word, uint32_t check) {
+    Bucket* b = bucket();
+    const int i = this - b->entries;
+    uint64_t* checkWord = &b->checks[i / ChecksPerWord];
+    const int shift = i % ChecksPerWord * CheckBits;
+    const uint64_t mask = uint64_t(CheckMask) << shift;
+
+    // Data first, then check. A reader in between sees a mismatch rather than a wrong entry
+    data = word;
+
+    uint64_t expected = __atomic_load_n(checkWord, __ATOMIC_RELAXED);
+    while (!__atomic_compare_exchange_n(checkWord, &expected, (expected & ~mask) | uint64_t(check) << shift,
+                                        true, __ATOMIC_RELEASE, __ATOMIC_RELAXED)) {}
   }
 }
@@ -14,17 +14,36 @@ namespace TT {
     FLAG_EXACT = FLAG_LOWER | FLAG_UPPER,
     FLAG_PV = 4;
 
+#if defined(TT_BUCKET64)
+  // One bucket per cache line. Fewer buckets, but each fetched line holds twice the candidates
+  constexpr int EntriesPerBucket = 6;
+#else
+  // Two buckets per cache line
   constexpr int EntriesPerBucket = 3;
+#endif
 
-  struct Entry {
+  // Extra key bits per entry, kept next to its 16 bit check
+  constexpr int KeyExtBits = 5;
 
-    void store(Key _key, Flag _bound, int _depth, Move _move, Score _score, Score _eval, bool isPV, int ply);
+  // Extra key bits of an entry moved by a resize, that can't tell where its key falls in the new
+  // bucket. They match any key. Keys whose bits are 0 are stored like this as well
+  constexpr uint16_t KeyExtUnknown = 0;
 
-    int getAgeDistance();
+  // The check and extra key bits of an entry take 21 bits of a 64 bit word, which holds those of 3 entries
+  constexpr int CheckBits = 16 + KeyExtBits;
+  constexpr int ChecksPerWord = 3;
 
-    inline bool matches(Key key) const {
-      return this->key16 == (uint16_t) key;
-    }
+  static_assert(CheckBits * ChecksPerWord <= 64);
+  static_assert(EntriesPerBucket % ChecksPerWord == 0);
+
+  // Everything an entry knows about a position, except its key.
+  // It fits in 64 bits, so that it can be read and written at once
+  struct EntryData {
+
+    int getAgeDistance() const;
+
+    // Written before the last new generation. Such entries count as empty
+    bool isStale() const;
 
     inline Score getStaticEval() const {
       return staticEval;
@@ -63,11 +82,9 @@ namespace TT {
     }
 
     inline bool isEmpty() const {
-      return score == 0 && agePvBound == 0;
+      return (score == 0 && agePvBound == 0) || isStale();
     }
 
-  private:
-    uint16_t key16;
     int16_t staticEval;
     uint8_t agePvBound;
     uint8_t depth;
@@ -75,21 +92,193 @@ namespace TT {
     int16_t score;
   };
 
+  static_assert(sizeof(EntryData) == sizeof(uint64_t));
+
+  struct Bucket;
+
+  struct Entry {
+
+    void store(Key _key, Flag _bound, int _depth, Move _move, Score _score, Score _eval, bool isPV, int ply);
+
+    // Read the data word once. Any later check must be done against this copy,
+    // because other threads may write to the entry at any time
+    inline EntryData load() const {
+      EntryData result;
+      const uint64_t word = data;
+      memcpy(&result, &word, sizeof(result));
+      return result;
+    }
+
+    // Read the check and the extra key bits, which are written together
+    inline uint32_t loadCheck() const;
+
+    // Write the data, then the check and the extra key bits
+    void write(uint64_t word, uint32_t check);
+
+    // The key is xored with the data, so that an entry whose data and check were
+    // written by two different stores (torn write) will most likely not match
+    static inline bool matches(Key key, const EntryData& snapshot, uint32_t check) {
+      uint64_t word;
+      memcpy(&word, &snapshot, sizeof(word));
+      return uint16_t(check ^ fold(word)) == (uint16_t) key;
+    }
+
+    static inline uint16_t keyExtOf(uint32_t check) {
+      return check >> 16;
+    }
+
+    static inline uint32_t makeCheck(Key key, uint64_t word, uint16_t ext) {
+      return uint16_t(uint16_t(key) ^ fold(word)) | uint32_t(ext) << 16;
+    }
+
+    static inline uint16_t fold(uint64_t word) {
+      return uint16_t(word ^ (word >> 16) ^ (word >> 32) ^ (word >> 48));
+    }
+
+  private:
+    // The bucket holding this entry, found by rounding down the address
+    inline Bucket* bucket() const;
+
+    uint64_t data;
+  };
+
+  // The checks are apart from the data, and an entry's is changed with a compare and swap
+  // on its word. A plain write of the whole word could undo a concurrent store to a sibling
   struct Bucket {
     Entry entries[EntriesPerBucket];
-    int16_t padding;
+    uint64_t checks[EntriesPerBucket / ChecksPerWord];
+
+    inline uint32_t loadCheck(int i) const {
+      const uint64_t word = __atomic_load_n(&checks[i / ChecksPerWord], __ATOMIC_RELAXED);
+      return (word >> (i % ChecksPerWord * CheckBits)) & ((1 << CheckBits) - 1);
+    }
   };
 
+  static_assert(sizeof(Bucket) == 32 || sizeof(Bucket) == 64,
+                "Entries find their bucket by rounding down their own address");
+
+  inline Bucket* Entry::bucket() const {
+    return (Bucket*) (uintptr_t(this) & ~uintptr_t(sizeof(Bucket) - 1));
+  }
+
+  inline uint32_t Entry::loadCheck() const {
+    const Bucket* b = bucket();
+    return b->loadCheck(this - b->entries);
+  }
+
+  // Counters of how the TT is used. Each search thread has its own, so that counting
+  // doesn't make threads write to shared cache lines
+  struct Stats {
+    uint64_t probes = 0;
+    uint64_t hits = 0;
+    uint64_t cutoffs = 0;      // hits whose score was returned right away
+    uint64_t stores = 0;
+    uint64_t replacements = 0; // stores over an entry of another position
+
+    void add(const Stats& other) {
+      probes += other.probes;
+      hits += other.hits;
+      cutoffs += other.cutoffs;
+      stores += other.stores;
+      replacements += other.replacements;
+    }
+  };
+
+  // Private copies of the buckets a search thread probed during one quantum of a deterministic
+  // search. Probes read and stores write the copies, while the shared table stays as it was at
+  // the start of the quantum. Between quanta, commit() writes the changed entries back
+  class Overlay {
+
+  public:
+    ~Overlay();
+
+    // Copy of the bucket with this index, made on first use. Null when the overlay is full
+    Bucket* get(uint64_t index);
+
+    // Whether 'entry' is in a copy that no longer belongs to the bucket with this index, because
+    // it was obtained before a commit. Such pointers are held across the search of a subtree
+    bool isStale(const Entry* entry, uint64_t index) const;
+
+    // Write entries that differ from the original copies to the shared table, and start over
+    void commit();
+
+  private:
+    static constexpr int CapacityBits = 15;
+    static constexpr uint32_t Capacity = 1 << CapacityBits;
+
+    Bucket* copies = nullptr;
+    Bucket* originals = nullptr;
+    uint64_t* indices = nullptr;
+    uint32_t* epochs = nullptr; // A slot is in use when it has the current epoch
+    uint32_t* order = nullptr;  // Slots in use, in the order they were taken
+    uint32_t used = 0;
+    uint32_t epoch = 1;
+  };
+
+  // Make probe and store of the calling thread count into 'stats'
+  void setThreadStats(Stats* stats);
+
+  // Make probe and store of the calling thread go through 'overlay' in deterministic mode
+  void setThreadOverlay(Overlay* overlay);
+
+  void setDeterministic(bool enabled);
+
+  // Print the counters, along with occupancy by depth and age, sampled from the table
+  void printStats(const Stats& stats);
+
   // Initialize/clear the TT
   void clear();
 
+  // O(1) alternative to clear(): entries written so far become empty to probe, and are
+  // the first to be replaced. The age has 5 bits, so this holds for the next 31 searches.
+  // Entries left untouched after that can be hit again
+  void newGeneration();
+
   void nextSearch();
 
-  void resize(size_t megaBytes);
+  // Reallocate the table, carrying over its entries. Unless told not to, the size and the kind of
+  // pages it got are reported as info strings
+  void resize(size_t megaBytes, bool report = true);
+
+  // Size of the table and what backs it, e.g. "64 MB in transparent huge pages"
+  std::string pagesInfo();
 
   void prefetch(Key key);
 
-  Entry* probe(Key key, bool& hit);
+  // Returns the entry that should be used to store this position.
+  // On hit, data is a consistent snapshot of that entry
+  Entry* probe(Key key, bool& hit, EntryData& data);
+
+  // Like prefetch and probe, but in the qsearch table of the calling thread, if there is one.
+  // Entries stored through the returned pointer go to the same table
+  void prefetchQs(Key key);
+
+  Entry* probeQs(Key key, bool& hit, EntryData& data);
 
+  // Size of the table each search thread keeps for its qsearch. Small enough to stay in L2,
+  // it keeps depth 0 entries from evicting deeper ones from the shared table. 0 disables it
+  void setQsTableSize(size_t kiloBytes);
+
+  // Permille of entries written by the current search, sampled from 1000 buckets spread over the table
   int hashfull();
+
+  // Map the buckets to this file on the next resize, so that they persist across restarts.
+  // An empty path means plain memory
+  void setFile(const std::string& path);
+
+  // Size of the table saved in a hash file, or 0 if it's not a valid file for this build
+  size_t fileMegaBytes(const std::string& path);
+
+  // Write the whole table, along with a header describing it, to a file
+  bool save(const std::string& path);
+
+  // Read a table written by save(). The Hash option is changed to match its size
+  bool load(const std::string& path);
+
+  // When enabled, the extra key bits must match too for probe to hit
+  void setWideKeys(bool enabled);
+
+  // How many entries passed the 16 bit check but had different extra key bits.
+  // These are rejected only when wide keys are enabled
+  uint64_t rejectedCollisions();
 }
@@ -4,16 +4,26 @@
 #include "move.h"
 #include "movegen.h"
 #include "nnue.h"
+#include "output.h"
 #include "search.h"
 #include "threads.h"
 #include "tt.h"
 #include "tuning.h"
 
+#include <algorithm>
+#include <atomic>
 #include <cassert>
+#include <cerrno>
 #include <cmath>
+#include <cstdlib>
+#include <condition_variable>
+#include <deque>
+#include <fstream>
 #include <iostream>
+#include <mutex>
 #include <sstream>
 #include <string>
+#include <thread>
 #include <vector>
 
 namespace {
@@ -22,6 +32,91 @@ namespace {
 
   std::vector<uint64_t> prevPositions;
 
+  // Commands are read from stdin by a thread of their own, and executed in order by the UCI
+  // thread. stop, quit and ponderhit also act as soon as they are read, so that they don't
+  // wait behind a command that blocks, like go waiting for the previous search or perft
+  struct Command {
+    std::string line;
+    uint64_t stopsBefore; // stops read before this command
+  };
+
+  std::mutex commandMutex;
+  std::condition_variable commandCv;
+  std::deque<Command> commands;
+  bool inGo = false; // UCI thread is executing a go command
+
+  std::atomic<uint64_t> stopsRead(0);
+
+  // Set when a stop arrives during the command being executed. Checked by perft
+  std::atomic<bool> commandStopped(false);
+
+  std::string firstToken(const std::string& line) {
+    std::istringstream is(line);
+    std::string token;
+    is >> token;
+    return token;
+  }
+
+  void readInput() {
+    std::string line;
+
+    while (true) {
+      if (!std::getline(std::cin, line))
+        line = "quit";
+
+      const std::string token = firstToken(line);
+
+      if (token == "stop" || token == "quit") {
+        stopsRead++;
+        commandStopped = true;
+        Threads::stopSearch();
+      }
+
+      // Queued as well. Should a go ponder be queued still, it's done again after it
+      if (token == "ponderhit")
+        Threads::ponderhit();
+
+      std::unique_lock lock(commandMutex);
+
+      // The engine is calculating and nothing is waiting before this, answer without queueing.
+      // Posted, so it comes after the lines the search has already posted
+      if (token == "isready" && inGo && commands.empty()) {
+        lock.unlock();
+        Output::post("readyok");
+        continue;
+      }
+
+      commands.push_back({ line, stopsRead });
+      lock.unlock();
+      commandCv.notify_one();
+
+      if (token == "quit")
+        return;
+    }
+  }
+
+  Command nextCommand() {
+    std::unique_lock lock(commandMutex);
+    commandCv.wait(lock, [] { return !commands.empty(); });
+
+    Command result = commands.front();
+    commands.pop_front();
+    inGo = firstToken(result.line) == "go";
+
+    // Any stop read after this command was queued is meant for it. The flag is cleared
+    // before looking at the count, a stop read meanwhile sets it again
+    commandStopped = false;
+    if (stopsRead != result.stopsBefore)
+      commandStopped = true;
+
+    return result;
+  }
+
+  void commandDone() {
+    std::lock_guard lock(commandMutex);
+    inGo = false;
+  }
+
   void position(Position& pos, std::istringstream& is) {
     Move m;
     std::string token, fen;
@@ -61,9 +156,12 @@ namespace {
     prevPositions.pop_back();
   }
 
-  void newGame() {
+  void newGame(bool allowLazy = true) {
 
-    TT::clear();
+    if (allowLazy && UCI::Options["Lazy Clear"])
+      TT::newGeneration();
+    else
+      TT::clear();
 
     for (Search::Thread* st : Threads::searchThreads)
       st->resetHistories();
@@ -87,7 +185,8 @@ namespace {
     std::string oldMinimal = UCI::Options["Minimal"];
     UCI::Options["Minimal"].set("true");
 
-    newGame();
+    // Clear fully, so that the node count doesn't depend on what was searched before
+    newGame(false);
 
     for (int i = 0; i < posCount; i++)
     {
@@ -114,6 +213,43 @@ namespace {
     UCI::Options["Minimal"].set(oldMinimal);
   }
 
+  // Throughput of NNUE::evaluate with the kernels in use: each bench position is evaluated
+  // 'repeat' times from the same accumulator, so that the updates aren't part of it
+  void evalbench(std::istringstream& is) {
+    int repeat = 20000;
+    is >> repeat;
+
+    constexpr int posCount = sizeof(BENCH_POSITIONS) / sizeof(char*);
+
+    NNUE::Accumulator* acc = new NNUE::Accumulator();
+    int64_t checksum = 0;
+    int64_t elapsed = 0;
+
+    for (int i = 0; i < posCount; i++) {
+      Position pos;
+      std::istringstream posStr(BENCH_POSITIONS[i]);
+      position(pos, posStr);
+
+      acc->refresh(pos, WHITE);
+      acc->refresh(pos, BLACK);
+
+      int64_t begin = timeMillis();
+      for (int j = 0; j < repeat; j++)
+        checksum += NNUE::evaluate(pos, *acc);
+      elapsed += timeMillis() - begin;
+    }
+
+    delete acc;
+    elapsed = std::max<int64_t>(elapsed, 1);
+
+    const int64_t evals = int64_t(posCount) * repeat;
+    std::cout << "kernels: " << NNUE::kernelsName()
+              << "\nevals: " << evals
+              << "\ntime: " << elapsed
+              << "\nevals/s: " << evals * 1000 / elapsed
+              << "\nchecksum: " << checksum << std::endl;
+  }
+
   void benccch(std::istringstream& is) {
 
     int movetime, hash, threads;
@@ -132,7 +268,8 @@ namespace {
     std::string oldMinimal = UCI::Options["Minimal"];
     UCI::Options["Minimal"].set("true");
 
-    newGame();
+    // Clear fully, so that the node count doesn't depend on what was searched before
+    newGame(false);
 
     for (int i = 0; i < posCount; i++)
     {
@@ -155,8 +292,274 @@ namespace {
     }
 
     std::cout << totalNodes << " nodes " << (totalNodes * 1000 / elapsed) << " nps" << std::endl;
+    std::cout << TT::rejectedCollisions() << " hash collisions detected" << std::endl;
+
+    UCI::Options["Minimal"].set(oldMinimal);
+  }
+
+  struct BenchRun {
+    int threads, hash;
+    int64_t elapsed = 0;
+    uint64_t nodes = 0;
+    TT::Stats ttStats;
+    std::vector<Move> bestMoves;
+  };
+
+  // Search every bench position to 'depth', each from an empty table as in a new game
+  BenchRun runBenchPositions(int depth, int threads, int hash) {
+    constexpr int posCount = sizeof(BENCH_POSITIONS) / sizeof(char*);
+
+    BenchRun run;
+    run.threads = threads;
+    run.hash = hash;
+
+    Threads::setThreadCount(threads);
+    TT::resize(hash);
+
+    for (int i = 0; i < posCount; i++)
+    {
+      newGame(false);
+
+      Search::Settings searchSettings;
+      searchSettings.depth = depth;
+
+      std::istringstream posStr(BENCH_POSITIONS[i]);
+      position(searchSettings.position, posStr);
+
+      searchSettings.startTime = timeMillis();
+      TT::nextSearch();
+      Threads::startSearch(searchSettings);
+      Threads::waitForSearch();
+
+      run.elapsed += timeMillis() - searchSettings.startTime;
+      run.nodes += Threads::totalNodes();
+      run.bestMoves.push_back(Threads::mainThread()->bestMove);
+    }
+
+    for (Search::Thread* st : Threads::searchThreads)
+      run.ttStats.add(st->ttStats);
+
+    run.elapsed = std::max<int64_t>(run.elapsed, 1);
+    return run;
+  }
+
+  // A positive integer from a benchmark argument, clamped to maxValue. Anything else is reported
+  // with an info string, and false is returned
+  bool parseBenchValue(const std::string& str, const char* what, int maxValue, int& result) {
+    char* end;
+    errno = 0;
+    const long value = std::strtol(str.c_str(), &end, 10);
+
+    if (str.empty() || *end || errno || value < 1) {
+      std::cout << "info string Invalid " << what << ": '" << str << "'" << std::endl;
+      return false;
+    }
+
+    result = std::min<long>(value, maxValue);
+    return true;
+  }
+
+  // Comma separated values, each checked by parseBenchValue
+  bool parseBenchList(const std::string& str, const char* what, int maxValue, std::vector<int>& result) {
+    result.clear();
+    std::stringstream ss(str);
+    std::string item;
+
+    // getline doesn't return an empty last item, as in "1,2,"
+    if (str.empty() || str.back() == ',')
+      return parseBenchValue("", what, maxValue, result.emplace_back());
+
+    while (std::getline(ss, item, ','))
+      if (!parseBenchValue(item, what, maxValue, result.emplace_back()))
+        return false;
+    return true;
+  }
+
+  // smpbench [depth] [max threads] [hash]
+  // Time to depth over the bench positions with 1, 2, 4, ... threads, and the speedup over 1 thread
+  void smpbench(std::istringstream& is) {
+
+    int depth = 10, maxThreads = UCI::Options["Threads"], hash = 64;
+    std::string depthStr, threadsStr, hashStr;
+    is >> depthStr >> threadsStr >> hashStr;
+
+    if (   (!depthStr.empty() && !parseBenchValue(depthStr, "depth", MAX_PLY - 1, depth))
+        || (!threadsStr.empty() && !parseBenchValue(threadsStr, "thread count", UCI::Options["Threads"].maxValue(), maxThreads))
+        || (!hashStr.empty() && !parseBenchValue(hashStr, "hash size", UCI::Options["Hash"].maxValue(), hash)))
+      return;
+
+    std::string oldMinimal = UCI::Options["Minimal"];
+    UCI::Options["Minimal"].set("true");
+
+    int64_t singleThreadTime = 0;
+
+    for (int threads = 1; ; threads = std::min(threads * 2, maxThreads)) {
+      BenchRun run = runBenchPositions(depth, threads, hash);
+
+      if (threads == 1)
+        singleThreadTime = run.elapsed;
+
+      const uint64_t nps = run.nodes * 1000 / run.elapsed;
+
+      std::cout << "threads " << threads
+                << " time-to-depth " << run.elapsed << " ms"
+                << " speedup " << double(singleThreadTime) / run.elapsed
+                << " nodes " << run.nodes
+                << " nps " << nps
+                << " nps/thread " << nps / threads << std::endl;
+
+      if (threads >= maxThreads)
+        break;
+    }
 
     UCI::Options["Minimal"].set(oldMinimal);
+
+    Threads::setThreadCount(UCI::Options["Threads"]);
+    TT::resize(UCI::Options["Hash"]);
+  }
+
+  // scalebench [depth N] [threads 1,2,4,...] [hash 16,64,...] [csv path] [json path]
+  // Bench positions to a fixed depth for every thread count and hash size. Each configuration is
+  // compared to 1 thread with the same hash, which is always run too
+  void scalebench(std::istringstream& is) {
+
+    int depth = 10;
+    std::vector<int> threadCounts, hashSizes;
+    std::string csvPath, jsonPath, token;
+
+    for (int t = 1; t <= int(UCI::Options["Threads"]); t *= 2)
+      threadCounts.push_back(t);
+    hashSizes.push_back(UCI::Options["Hash"]);
+
+    while (is >> token) {
+      bool valid = true;
+      std::string value;
+
+      if (token == "depth")        { is >> value; valid = parseBenchValue(value, "depth", MAX_PLY - 1, depth); }
+      else if (token == "threads") { is >> value; valid = parseBenchList(value, "thread count", UCI::Options["Threads"].maxValue(), threadCounts); }
+      else if (token == "hash")    { is >> value; valid = parseBenchList(value, "hash size", UCI::Options["Hash"].maxValue(), hashSizes); }
+      else if (token == "csv")     is >> csvPath;
+      else if (token == "json")    is >> jsonPath;
+
+      if (!valid)
+        return;
+    }
+
+    std::string oldMinimal = UCI::Options["Minimal"];
+    UCI::Options["Minimal"].set("true");
+
+    struct Row {
+      BenchRun run;
+      double speedup, efficiency, hitRate, agreement;
+    };
+    std::vector<Row> rows;
+
+    for (int hash : hashSizes) {
+      BenchRun single = runBenchPositions(depth, 1, hash);
+      const double singleNps = double(single.nodes) * 1000 / single.elapsed;
+
+      for (int threads : threadCounts) {
+        BenchRun run = threads == 1 ? single : runBenchPositions(depth, threads, hash);
+
+        int agreeing = 0;
+        for (int i = 0; i < run.bestMoves.size(); i++)
+          agreeing += run.bestMoves[i] == single.bestMoves[i];
+
+        Row row;
+        row.run = run;
+        row.speedup = double(single.elapsed) / run.elapsed;
+        row.efficiency = double(run.nodes) * 1000 / run.elapsed / threads / singleNps;
+        row.hitRate = run.ttStats.probes ? double(run.ttStats.hits) / run.ttStats.probes : 0;
+        row.agreement = double(agreeing) / run.bestMoves.size();
+        rows.push_back(row);
+
+        std::cout << "threads " << threads << " hash " << hash
+                  << " time-to-depth " << run.elapsed << " ms"
+                  << " speedup " << row.speedup
+                  << " nps " << run.nodes * 1000 / run.elapsed
+                  << " efficiency " << row.efficiency
+                  << " tt-hits " << row.hitRate
+                  << " agreement " << row.agreement << std::endl;
+      }
+    }
+
+    UCI::Options["Minimal"].set(oldMinimal);
+
+    Threads::setThreadCount(UCI::Options["Threads"]);
+    TT::resize(UCI::Options["Hash"]);
+
+    if (!csvPath.empty()) {
+      std::ofstream csv(csvPath);
+      csv << "threads,hash_mb,depth,time_ms,nodes,nps,speedup,nps_efficiency,tt_hit_rate,bestmove_agreement\n";
+      for (const Row& row : rows)
+        csv << row.run.threads << "," << row.run.hash << "," << depth << ","
+            << row.run.elapsed << "," << row.run.nodes << "," << row.run.nodes * 1000 / row.run.elapsed << ","
+            << row.speedup << "," << row.efficiency << "," << row.hitRate << "," << row.agreement << "\n";
+      std::cout << "info string Results written to " << csvPath << std::endl;
+    }
+
+    if (!jsonPath.empty()) {
+      std::ofstream json(jsonPath);
+      json << "[\n";
+      for (int i = 0; i < rows.size(); i++) {
+        const Row& row = rows[i];
+        json << "  {\"threads\": " << row.run.threads << ", \"hash_mb\": " << row.run.hash
+             << ", \"depth\": " << depth << ", \"time_ms\": " << row.run.elapsed
+             << ", \"nodes\": " << row.run.nodes << ", \"nps\": " << row.run.nodes * 1000 / row.run.elapsed
+             << ", \"speedup\": " << row.speedup << ", \"nps_efficiency\": " << row.efficiency
+             << ", \"tt_hit_rate\": " << row.hitRate << ", \"bestmove_agreement\": " << row.agreement
+             << "}" << (i + 1 < rows.size() ? "," : "") << "\n";
+      }
+      json << "]\n";
+      std::cout << "info string Results written to " << jsonPath << std::endl;
+    }
+  }
+
+  void savehash(std::istringstream& is) {
+    std::string path;
+    std::getline(is >> std::ws, path);
+
+    Threads::waitForSearch();
+
+    if (TT::save(path))
+      std::cout << "info string Hash saved to " << path << std::endl;
+    else
+      std::cout << "info string Could not save hash to " << path << std::endl;
+  }
+
+  void loadhash(std::istringstream& is) {
+    std::string path;
+    std::getline(is >> std::ws, path);
+
+    Threads::waitForSearch();
+
+    if (TT::load(path))
+      std::cout << "info string Hash loaded from " << path << std::endl;
+    else
+      std::cout << "info string Could not load hash from " << path << std::endl;
+  }
+
+  void tt(std::istringstream& is) {
+    std::string token;
+    is >> token;
+
+    if (token != "stats") {
+      std::cout << "Usage: tt stats [reset]" << std::endl;
+      return;
+    }
+
+    is >> token;
+    TT::Stats total;
+
+    for (Search::Thread* st : Threads::searchThreads) {
+      if (token == "reset")
+        st->ttStats = TT::Stats();
+      else
+        total.add(st->ttStats);
+    }
+
+    if (token != "reset")
+      TT::printStats(total);
   }
 
   void setoption(std::istringstream& is) {
@@ -205,17 +608,24 @@ namespace {
       else if (token == "nodes")     is >> searchSettings.nodes;
       else if (token == "movetime")  is >> searchSettings.movetime;
       else if (token == "perft")     is >> perftPlies;
+      else if (token == "ponder")    searchSettings.ponder = true;
 
     Threads::waitForSearch();
 
     if (perftPlies) {
       int64_t begin = timeMillis();
-      int64_t nodes = Search::perft<true>(pos, perftPlies);
-      int64_t took = timeMillis() - begin;
+      int64_t nodes = Search::perft<true>(pos, perftPlies, commandStopped);
+      int64_t took = std::max<int64_t>(timeMillis() - begin, 1);
+
+      if (commandStopped)
+        Output::post("perft stopped, partial count");
+
+      Output::post("nodes: " + std::to_string(nodes));
+      Output::post("time: " + std::to_string(took));
+      Output::post("nps: " + std::to_string(int(nodes * 1000 / took)));
 
-      std::cout << "nodes: " << nodes << std::endl;
-      std::cout << "time: " << took << std::endl;
-      std::cout << "nps: " << int(nodes * 1000 / took) << std::endl;
+      // Commands after this one write to std::cout directly
+      Output::flush();
       return;
     }
     else {
@@ -237,9 +647,15 @@ void UCI::loop(int argc, char* argv[]) {
   for (int i = 1; i < argc; ++i)
     cmd += std::string(argv[i]) + " ";
 
+  std::thread reader;
+  if (argc == 1)
+    reader = std::thread(readInput);
+
   do {
-    if (argc == 1 && !std::getline(std::cin, cmd))
-      cmd = "quit";
+    if (argc == 1) {
+      commandDone();
+      cmd = nextCommand().line;
+    }
 
     std::istringstream is(cmd);
 
@@ -256,18 +672,31 @@ void UCI::loop(int argc, char* argv[]) {
     else if (token == "uci") {
       std::cout << "id name Obsidian " << engineVersion
         << "\nid author Gabriele Lombardo"
+        << "\ninfo string NNUE kernels: " << NNUE::kernelsName()
+        << "\ninfo string Hash: " << TT::pagesInfo()
         << Options
         << "\n" << paramsToUci()
         << "uciok" << std::endl;
     }
+    else if (token == "ponderhit")  Threads::ponderhit();
     else if (token == "qc")         qc(pos);
     else if (token == "bench")      bench();
     else if (token == "benccch")      benccch(is);
+    else if (token == "evalbench")  evalbench(is);
+    else if (token == "smpbench")   smpbench(is);
+    else if (token == "scalebench") scalebench(is);
     else if (token == "setoption")  setoption(is);
+    else if (token == "savehash")   savehash(is);
+    else if (token == "loadhash")   loadhash(is);
+    else if (token == "tt")         tt(is);
     else if (token == "go")         go(pos, is);
     else if (token == "position")   position(pos, is);
     else if (token == "ucinewgame") newGame();
-    else if (token == "isready")    std::cout << "readyok" << std::endl;
+    else if (token == "isready") {
+      // After a bestmove that may still be queued
+      Output::flush();
+      std::cout << "readyok" << std::endl;
+    }
     else if (token == "d")          std::cout << pos << std::endl;
     else if (token == "tune")       std::cout << paramsToSpsaInput();
     else if (token == "eval") {
@@ -284,6 +713,10 @@ void UCI::loop(int argc, char* argv[]) {
       std::cout << "Unknown command: '" << cmd << "'." << std::endl;
 
   } while (token != "quit" && argc == 1);
+
+  // It has returned after queueing quit
+  if (reader.joinable())
+    reader.join();
 }
 
 int UCI::normalizeToCp(Score v) {
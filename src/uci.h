@@ -43,6 +43,10 @@ namespace UCI {
 
     bool operator==(const char*) const;
 
+    // Bounds of a spin option
+    int minValue() const { return min; }
+    int maxValue() const { return max; }
+
   private:
     friend std::ostream& operator<<(std::ostream&, const OptionsMap&);
 
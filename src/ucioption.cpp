@@ -1,6 +1,7 @@
 #include "uci.h"
 #include "fathom/src/tbprobe.h"
 #include "nnue.h"
+#include "numa.h"
 #include "threads.h"
 #include "tt.h"
 
@@ -24,12 +25,58 @@ void hashChanged(const Option& o) {
    TT::resize(size_t(o));
 }
 
+void hashFileChanged(const Option& o) {
+   TT::setFile(o);
+
+   // An existing table dictates the size, otherwise it would be discarded by the resize
+   size_t fileMB = TT::fileMegaBytes(o);
+   if (fileMB && fileMB != size_t(Options["Hash"]))
+     Options["Hash"].set(std::to_string(fileMB));
+   else
+     TT::resize(Options["Hash"]);
+}
+
+void qsHashChanged(const Option& o) {
+   TT::setQsTableSize(size_t(o));
+}
+
+void largePagesChanged(const Option&) {
+   TT::resize(Options["Hash"]);
+   Threads::setThreadCount(Options["Threads"]);
+}
+
+void wideHashKeysChanged(const Option& o) {
+   TT::setWideKeys(bool(int(o)));
+}
+
 void threadsChanged(const Option& o) {
   int count = int(o);
   Threads::setThreadCount(count);
   //NNUE::loadWeights(count > 32); // CCC and TCEC
 }
 
+void deterministicChanged(const Option& o) {
+  Threads::setDeterministic(bool(int(o)));
+}
+
+void numaChanged(const Option& o) {
+  Numa::setEnabled(int(o));
+  // Recreate threads and TT, so that they are bound and allocated according to the new mode
+  Threads::setThreadCount(Options["Threads"]);
+  TT::resize(Options["Hash"]);
+  std::cout << "info string NUMA nodes in use: " << Numa::nodeCount() << std::endl;
+}
+
+void evalFileChanged(const Option& o) {
+  // Read and check the net while a search may still be running, swap it in once it's over
+  std::string info;
+  NNUE::Net* net = NNUE::readNet(o, info);
+  Threads::waitForSearch();
+  if (net)
+    NNUE::setNet(net);
+  std::cout << "info string " << info << std::endl;
+}
+
 void syzygyPathChanged(const Option& o) {
   std::string str = o;
   tb_init(str.c_str());
@@ -93,10 +140,23 @@ void init() {
   Options["Contempt"]          = Option(0, 0, 512, refreshContempt);
   Options["ContemptOverrides"] = Option("", refreshContempt);
   Options["Hash"]              = Option(64, 1, MaxHashMB, hashChanged);
+  Options["QSearch Hash KB"]   = Option(0, 0, 65536, qsHashChanged);
   Options["Clear Hash"]        = Option(clearHashClicked);
+  Options["Lazy Clear"]        = Option(true);
+  Options["Wide Hash Keys"]    = Option(false, wideHashKeysChanged);
+  Options["LargePages"]        = Option(true, largePagesChanged);
+  Options["HashFile"]          = Option("", hashFileChanged);
   Options["Threads"]           = Option(1, 1, 1024, threadsChanged);
+  Options["NUMA"]              = Option(false, numaChanged);
+  Options["Deterministic"]     = Option(false, deterministicChanged);
+  Options["SMP Depth Skip"]    = Option(false);
+  Options["SMP Asp Offset"]    = Option(0, 0, 100);
+  Options["SMP Root Noise"]    = Option(0, 0, 16384);
+  Options["SMP Seed"]          = Option(0, 0, 1000000);
   Options["Move Overhead"]     = Option(10, 0, 1000);
+  Options["Ponder"]            = Option(false);
   Options["SyzygyPath"]        = Option("", syzygyPathChanged);
+  Options["EvalFile"]          = Option("", evalFileChanged);
   Options["Minimal"]           = Option("false");
   Options["MultiPV"]           = Option(1, 1, MAX_MOVES);
   Options["UCI_Opponent"]      = Option("", refreshContempt);
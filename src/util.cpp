@@ -0,0 +1,170 @@
+#include "util.h"
+
+#if defined(__linux__)
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+#include <fstream>
+#include <sstream>
+
+namespace Util {
+
+  constexpr size_t MB2 = size_t(2) << 20;
+  constexpr size_t GB1 = size_t(1) << 30;
+
+  std::string pageTypeToString(PageType type) {
+    switch (type) {
+      case PAGES_HUGE_1GB:    return "1GB huge pages (hugetlbfs)";
+      case PAGES_HUGE_2MB:    return "2MB huge pages (hugetlbfs)";
+      case PAGES_TRANSPARENT: return "transparent huge pages";
+      default:                return "normal pages";
+    }
+  }
+
+  inline size_t roundUp(size_t size, size_t align) {
+    return ((size + align - 1) / align) * align;
+  }
+
+#if defined(__linux__) && defined(MAP_HUGETLB) && defined(MAP_HUGE_SHIFT)
+  void* mapHuge(size_t size, int log2PageSize) {
+    void* result = mmap(nullptr, size, PROT_READ | PROT_WRITE,
+      MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB | (log2PageSize << MAP_HUGE_SHIFT), -1, 0);
+    return result == MAP_FAILED ? nullptr : result;
+  }
+#endif
+
+  void* allocLarge(size_t size, bool allowHuge, PageType& type) {
+
+#if defined(__linux__) && defined(MAP_HUGETLB) && defined(MAP_HUGE_SHIFT)
+    if (allowHuge) {
+      // 1GB pages only when they waste nothing, the reservation is all-or-nothing
+      if (size % GB1 == 0) {
+        if (void* result = mapHuge(size, 30)) {
+          type = PAGES_HUGE_1GB;
+          return result;
+        }
+      }
+      if (void* result = mapHuge(roundUp(size, MB2), 21)) {
+        type = PAGES_HUGE_2MB;
+        return result;
+      }
+    }
+#endif
+
+    void* result = _mm_malloc(roundUp(size, MB2), MB2);
+    type = PAGES_NORMAL;
+
+#if defined(__linux__)
+    if (allowHuge && !madvise(result, roundUp(size, MB2), MADV_HUGEPAGE))
+      type = PAGES_TRANSPARENT;
+#endif
+
+    return result;
+  }
+
+  void freeLarge(void* ptr, size_t size, PageType type) {
+    if (!ptr)
+      return;
+
+#if defined(__linux__)
+    if (type == PAGES_HUGE_1GB) {
+      munmap(ptr, size);
+      return;
+    }
+    if (type == PAGES_HUGE_2MB) {
+      munmap(ptr, roundUp(size, MB2));
+      return;
+    }
+#endif
+
+    _mm_free(ptr);
+  }
+
+  void* mapFileShared(const std::string& path, size_t size, size_t& previousSize) {
+#if defined(__linux__)
+    int fd = open(path.c_str(), O_RDWR | O_CREAT, 0644);
+    if (fd < 0)
+      return nullptr;
+
+    struct stat st;
+    void* result = nullptr;
+
+    if (!fstat(fd, &st)) {
+      previousSize = st.st_size;
+      if (previousSize == size || !ftruncate(fd, size)) {
+        result = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        if (result == MAP_FAILED)
+          result = nullptr;
+      }
+    }
+
+    // The mapping stays valid after the descriptor is closed
+    close(fd);
+    return result;
+#else
+    return nullptr;
+#endif
+  }
+
+  const void* mapFileReadOnly(const std::string& path, size_t& size) {
+#if defined(__linux__)
+    int fd = open(path.c_str(), O_RDONLY);
+    if (fd < 0)
+      return nullptr;
+
+    struct stat st;
+    void* result = nullptr;
+
+    if (!fstat(fd, &st) && st.st_size > 0) {
+      size = st.st_size;
+      result = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+      if (result == MAP_FAILED)
+        result = nullptr;
+    }
+
+    close(fd);
+    return result;
+#else
+    return nullptr;
+#endif
+  }
+
+  void unmapFile(void* ptr, size_t size) {
+#if defined(__linux__)
+    munmap(ptr, size);
+#endif
+  }
+
+  size_t transparentHugeBytes(void* ptr, size_t size) {
+    size_t result = 0;
+
+#if defined(__linux__)
+    const uintptr_t begin = uintptr_t(ptr), end = begin + size;
+
+    std::ifstream smaps("/proc/self/smaps");
+    std::string line;
+    bool inRange = false;
+
+    while (std::getline(smaps, line)) {
+      // Mapping header, such as "7f0000000000-7f0040000000 rw-p ..."
+      size_t dash = line.find('-');
+      if (dash != std::string::npos && dash < line.find(' ')) {
+        uintptr_t vmaBegin = std::stoull(line.substr(0, dash), nullptr, 16);
+        uintptr_t vmaEnd = std::stoull(line.substr(dash + 1), nullptr, 16);
+        inRange = vmaBegin < end && vmaEnd > begin;
+        continue;
+      }
+
+      if (inRange && line.rfind("AnonHugePages:", 0) == 0) {
+        std::istringstream is(line.substr(14));
+        size_t kb;
+        is >> kb;
+        result += kb * 1024;
+      }
+    }
+#endif
+
+    return result;
+  }
+}
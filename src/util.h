@@ -4,6 +4,8 @@
 #include <sys/mman.h>
 #endif
 #include <cstdlib>
+#include <immintrin.h>
+#include <string>
 
 namespace Util {
 
@@ -24,4 +26,33 @@ namespace Util {
   inline void freeAlign(void* ptr) {
     _mm_free(ptr);
   }
-}
\ No newline at end of file
+
+  enum PageType {
+    PAGES_NORMAL,
+    PAGES_TRANSPARENT, // transparent huge pages, requested with madvise
+    PAGES_HUGE_2MB,    // explicit huge pages from hugetlbfs
+    PAGES_HUGE_1GB
+  };
+
+  std::string pageTypeToString(PageType type);
+
+  // Allocate a large block. When allowHuge is set, try explicit huge pages first,
+  // then transparent huge pages. The type actually used is written to 'type'
+  void* allocLarge(size_t size, bool allowHuge, PageType& type);
+
+  void freeLarge(void* ptr, size_t size, PageType type);
+
+  // Map a file for reading and writing, shared with the page cache, creating it or
+  // changing its size if needed. The size it had before is written to 'previousSize'
+  void* mapFileShared(const std::string& path, size_t size, size_t& previousSize);
+
+  // Map a whole file read-only. Its size is written to 'size'. Null if it can't be opened,
+  // is empty, or the platform has no mmap
+  const void* mapFileReadOnly(const std::string& path, size_t& size);
+
+  void unmapFile(void* ptr, size_t size);
+
+  // How many bytes of [ptr, ptr+size) are currently backed by transparent huge pages.
+  // Only meaningful after the memory has been touched
+  size_t transparentHugeBytes(void* ptr, size_t size);
+}